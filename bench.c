@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Microbenchmarks for the lib.c hot paths: run with no arguments,
+ * scenarios print ops/sec and bytes/sec. Each scenario gets a fresh
+ * filesystem image, one untimed warmup pass and NUMBFS_BENCH_RUNS
+ * timed repetitions; the best repetition is reported.
+ */
+#include "internal.h"
+#include "disk.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define BENCH_FILE_SIZE         (32 * 1024 * 1024)
+#define BENCH_NUM_INODES        4096
+#define BENCH_RUNS              3
+
+/* per-run transfer sizes, sized well below the data zone */
+#define BENCH_STREAM_BYTES      (16 * 1024 * 1024)
+#define BENCH_CHUNK_BYTES       (1024 * 1024)
+#define BENCH_RANDOM_WRITES     20000
+#define BENCH_CACHED_READS      200000
+#define BENCH_SCAN_ROUNDS       100
+
+static struct numbfs_superblock_info sbi;
+static const char *bench_file = "./numbfs_bench_file_xxx";
+
+struct bench_result {
+        long long ops;
+        long long bytes;
+};
+
+static double bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* rebuild a fresh filesystem in the image, outside the timed region */
+static void bench_reset(int feature)
+{
+        int total_blocks, remain;
+        char *chunk;
+        off_t start, end;
+
+        BUG_ON(numbfs_bitmap_release(&sbi));
+        BUG_ON(numbfs_cache_destroy(&sbi));
+
+        sbi.size = BENCH_FILE_SIZE;
+        sbi.block_size = BYTES_PER_BLOCK;
+        sbi.feature = NUMBFS_FEATURE_LAZY_ITABLE | feature;
+
+        total_blocks = sbi.size / BYTES_PER_BLOCK;
+        sbi.total_inodes = BENCH_NUM_INODES;
+        sbi.free_inodes = sbi.total_inodes;
+
+        sbi.ibitmap_start = 2;
+        sbi.inode_start = sbi.ibitmap_start +
+                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.total_inodes, BITS_PER_BYTE), BYTES_PER_BLOCK);
+        sbi.bbitmap_start = sbi.inode_start +
+                        DIV_ROUND_UP(sbi.total_inodes * sizeof(struct numbfs_inode), BYTES_PER_BLOCK);
+
+        remain = total_blocks - sbi.bbitmap_start - 1;
+        sbi.data_blocks = remain -
+                        DIV_ROUND_UP(DIV_ROUND_UP(remain, BITS_PER_BYTE), BYTES_PER_BLOCK);
+        sbi.free_blocks = sbi.data_blocks;
+
+        start = 2;
+        end = sbi.bbitmap_start +
+                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.data_blocks, BITS_PER_BYTE), BYTES_PER_BLOCK);
+        chunk = calloc(end - start, BYTES_PER_BLOCK);
+        BUG_ON(!chunk);
+        BUG_ON(numbfs_write_blocks(&sbi, chunk, start, end - start));
+        free(chunk);
+        sbi.data_start = end;
+}
+
+/* allocate every data block, then free them all */
+static int bench_block_alloc(struct bench_result *res)
+{
+        int i, blk, err;
+
+        for (i = 0; i < sbi.data_blocks; i++) {
+                err = numbfs_alloc_block(&sbi, &blk);
+                if (err)
+                        return err;
+        }
+        for (i = 0; i < sbi.data_blocks; i++) {
+                err = numbfs_free_block(&sbi, i);
+                if (err)
+                        return err;
+        }
+        res->ops += 2 * sbi.data_blocks;
+        return 0;
+}
+
+/* sequential streaming writes through one extent-mapped inode */
+static int bench_write_seq(struct bench_result *res)
+{
+        struct numbfs_inode_info inode;
+        char *buf;
+        int pos, err;
+
+        inode.sbi = &sbi;
+        inode.nid = 1;
+        err = numbfs_get_inode(&sbi, &inode);
+        if (err)
+                return err;
+
+        buf = malloc(BENCH_CHUNK_BYTES);
+        if (!buf)
+                return -ENOMEM;
+        memset(buf, 0x5a, BENCH_CHUNK_BYTES);
+
+        for (pos = 0; pos < BENCH_STREAM_BYTES; pos += BENCH_CHUNK_BYTES) {
+                err = numbfs_pwrite_inode_stream(&inode, buf, pos,
+                                                 BENCH_CHUNK_BYTES);
+                if (err)
+                        goto out;
+        }
+        err = numbfs_iput(&inode);
+        res->ops += BENCH_STREAM_BYTES / BENCH_CHUNK_BYTES;
+        res->bytes += BENCH_STREAM_BYTES;
+out:
+        free(buf);
+        return err;
+}
+
+/* sequential streaming reads of what bench_write_seq laid out */
+static int bench_read_seq(struct bench_result *res)
+{
+        struct numbfs_inode_info inode;
+        char *buf;
+        int pos, err;
+
+        inode.sbi = &sbi;
+        inode.nid = 1;
+        err = numbfs_get_inode(&sbi, &inode);
+        if (err)
+                return err;
+
+        buf = malloc(BENCH_CHUNK_BYTES);
+        if (!buf)
+                return -ENOMEM;
+
+        for (pos = 0; pos < BENCH_STREAM_BYTES; pos += BENCH_CHUNK_BYTES) {
+                err = numbfs_pread_inode_stream(&inode, buf, pos,
+                                                BENCH_CHUNK_BYTES);
+                if (err)
+                        goto out;
+        }
+        res->ops += BENCH_STREAM_BYTES / BENCH_CHUNK_BYTES;
+        res->bytes += BENCH_STREAM_BYTES;
+out:
+        free(buf);
+        return err;
+}
+
+/* single-block writes at random offsets of random inodes */
+static int bench_write_random(struct bench_result *res)
+{
+        struct numbfs_inode_info inode;
+        char buf[BYTES_PER_BLOCK];
+        unsigned int seed = 0x4e554d42;
+        int i, err;
+
+        memset(buf, 0xa5, BYTES_PER_BLOCK);
+        for (i = 0; i < BENCH_RANDOM_WRITES; i++) {
+                inode.sbi = &sbi;
+                inode.nid = rand_r(&seed) % BENCH_NUM_INODES;
+                err = numbfs_get_inode(&sbi, &inode);
+                if (err)
+                        return err;
+                err = numbfs_pwrite_inode(&inode, buf,
+                                (rand_r(&seed) % NUMBFS_NUM_DATA_ENTRY) *
+                                        BYTES_PER_BLOCK,
+                                BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+                err = numbfs_iput(&inode);
+                if (err)
+                        return err;
+        }
+        res->ops += BENCH_RANDOM_WRITES;
+        res->bytes += (long long)BENCH_RANDOM_WRITES * BYTES_PER_BLOCK;
+        return 0;
+}
+
+/* repeated reads of a small working set through the block cache */
+static int bench_cached_read(struct bench_result *res)
+{
+        char buf[BYTES_PER_BLOCK];
+        unsigned int seed = 0x4e554d42;
+        int i, err;
+
+        for (i = 0; i < BENCH_CACHED_READS; i++) {
+                err = numbfs_read_block(&sbi, buf,
+                        sbi.inode_start + rand_r(&seed) % (NUMBFS_CACHE_BLOCKS / 2));
+                if (err)
+                        return err;
+        }
+        res->ops += BENCH_CACHED_READS;
+        res->bytes += (long long)BENCH_CACHED_READS * BYTES_PER_BLOCK;
+        return 0;
+}
+
+/* the fsck bitmap usage scan over the block bitmap zone */
+static int bench_bitmap_scan(struct bench_result *res)
+{
+        int i, cnt, err;
+
+        for (i = 0; i < BENCH_SCAN_ROUNDS; i++) {
+                err = numbfs_popcount_range(&sbi, sbi.bbitmap_start,
+                                            sbi.data_start - sbi.bbitmap_start,
+                                            &cnt);
+                if (err)
+                        return err;
+        }
+        res->ops += BENCH_SCAN_ROUNDS;
+        res->bytes += (long long)BENCH_SCAN_ROUNDS *
+                        (sbi.data_start - sbi.bbitmap_start) * BYTES_PER_BLOCK;
+        return 0;
+}
+
+struct bench_scenario {
+        const char *name;
+        int feature;
+        int (*run)(struct bench_result *res);
+        /* untimed setup, e.g. laying out data for a read scenario */
+        int (*prepare)(struct bench_result *res);
+};
+
+static struct bench_scenario scenarios[] = {
+        { "block alloc+free",    0,                     bench_block_alloc,  NULL },
+        { "inode write seq",     NUMBFS_FEATURE_EXTENT, bench_write_seq,    NULL },
+        { "inode read seq",      NUMBFS_FEATURE_EXTENT, bench_read_seq,     bench_write_seq },
+        { "inode write random",  0,                     bench_write_random, NULL },
+        { "cached block read",   0,                     bench_cached_read,  NULL },
+        { "bitmap scan",         0,                     bench_bitmap_scan,  NULL },
+};
+
+static int bench_run_one(struct bench_scenario *s)
+{
+        struct bench_result res;
+        double t0, best = 0;
+        int i, err;
+
+        for (i = 0; i <= BENCH_RUNS; i++) {
+                bench_reset(s->feature);
+                res.ops = res.bytes = 0;
+                if (s->prepare) {
+                        err = s->prepare(&res);
+                        if (err)
+                                return err;
+                        res.ops = res.bytes = 0;
+                }
+
+                t0 = bench_now();
+                err = s->run(&res);
+                if (err)
+                        return err;
+                t0 = bench_now() - t0;
+
+                /* the first pass is warmup */
+                if (i && (!best || t0 < best))
+                        best = t0;
+        }
+
+        printf("%-20s %12.0f ops/s %10.1f MB/s\n", s->name,
+               res.ops / best, res.bytes / best / (1024.0 * 1024.0));
+        return 0;
+}
+
+int main(void)
+{
+        int fd, i, err;
+
+        fd = open(bench_file, O_RDWR | O_CREAT, 0644);
+        BUG_ON(fd < 0);
+        BUG_ON(ftruncate(fd, BENCH_FILE_SIZE));
+
+        memset(&sbi, 0, sizeof(sbi));
+        sbi.fd = fd;
+        sbi.size = BENCH_FILE_SIZE;
+        BUG_ON(numbfs_map_device(&sbi, BENCH_FILE_SIZE));
+
+        printf("numbfs_bench: %d MiB image, best of %d runs\n",
+               BENCH_FILE_SIZE >> 20, BENCH_RUNS);
+        for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++) {
+                err = bench_run_one(&scenarios[i]);
+                if (err) {
+                        fprintf(stderr, "error: scenario '%s' failed: %d\n",
+                                scenarios[i].name, err);
+                        break;
+                }
+        }
+
+        BUG_ON(numbfs_bitmap_release(&sbi));
+        BUG_ON(numbfs_cache_destroy(&sbi));
+        BUG_ON(numbfs_unmap_device(&sbi));
+        close(fd);
+        remove(bench_file);
+        return err ? 1 : 0;
+}
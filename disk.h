@@ -12,6 +12,24 @@
 
 #define NUMBFS_MAGIC    0x4E554D42 /* "NUMB" */
 
+/* superblock feature bits */
+/* i_data[] holds (start, len) extent pairs instead of direct blocks */
+#define NUMBFS_FEATURE_EXTENT   0x00000001
+/*
+ * The inode zone is lazily initialized: mkfs leaves it all-zero and
+ * a slot with zero i_mode/i_nlink is read as an empty inode whose
+ * data entries are all holes.
+ */
+#define NUMBFS_FEATURE_LAZY_ITABLE      0x00000002
+/* metadata updates go through the intent-log journal zone */
+#define NUMBFS_FEATURE_JOURNAL  0x00000004
+/* the superblock and metadata zones carry crc32c checksums */
+#define NUMBFS_FEATURE_CSUM     0x00000008
+/* directories use packed variable-length dirents */
+#define NUMBFS_FEATURE_CDIR     0x00000010
+/* small files may keep their bytes in i_data[] (see NUMBFS_I_INLINE) */
+#define NUMBFS_FEATURE_INLINE   0x00000020
+
 /* the first block is reserved */
 #define NUMBFS_SUPER_OFFSET BYTES_PER_BLOCK
 
@@ -45,8 +63,20 @@ struct numbfs_super_block {
 	__le32 s_data_blocks;
 	/* num of free data blocks */
 	__le32 s_free_blocks;
+	/* block size in bytes, 0 means the old default of 512 */
+	__le32 s_block_size;
+	/* first block of the journal zone (NUMBFS_FEATURE_JOURNAL) */
+	__le32 s_journal_start;
+	/* size of the journal zone in blocks, header included */
+	__le32 s_journal_blocks;
+	/* crc32c of each metadata zone (NUMBFS_FEATURE_CSUM) */
+	__le32 s_ibitmap_csum;
+	__le32 s_itable_csum;
+	__le32 s_bbitmap_csum;
+	/* crc32c of this superblock, computed with the field zeroed */
+	__le32 s_checksum;
 	/* reserved */
-	__u8 s_reserved[88];
+	__u8 s_reserved[60];
 };
 
 /* 64-byte on-disk numbfs inode */
@@ -61,11 +91,19 @@ struct numbfs_inode {
 	__le32 i_xattr_start;
 	/* number of xattrs */
 	__u8 i_xattr_count;
-	__u8 reserved2[3]; /* padding */
+	/* per-inode flag bits, see NUMBFS_I_* */
+	__u8 i_flags;
+	__u8 reserved2[2]; /* padding */
 	/* block addr of data blocks */
 	__le32 i_data[10];
 };
 
+/* i_data[] holds the file bytes themselves, not block addresses */
+#define NUMBFS_I_INLINE	0x01
+
+/* bytes of file data that fit in the i_data[] area */
+#define NUMBFS_INLINE_MAX	(NUMBFS_NUM_DATA_ENTRY * 4)
+
 /* 64-byte on-disk numbfs dirent */
 struct numbfs_dirent {
 	__u8 name_len;
@@ -74,7 +112,52 @@ struct numbfs_dirent {
 	__le16 ino;
 };
 
-/* on-disk xattr entry */
+/* packed dirents start at multiples of this within a block */
+#define NUMBFS_CDIR_ALIGN       8
+
+/*
+ * Packed variable-length dirent (NUMBFS_FEATURE_CDIR): a 6-byte
+ * header followed by the name, with rec_len rounded up to
+ * NUMBFS_CDIR_ALIGN. Records never cross a block boundary; a
+ * zero rec_len marks the unused tail of a block.
+ */
+struct numbfs_cdirent {
+	__le16 ino;
+	/* distance to the next record */
+	__le16 rec_len;
+	__u8 name_len;
+	__u8 type;
+	/* name_len bytes, not NUL-terminated */
+	char name[];
+};
+
+#define NUMBFS_JOURNAL_MAGIC    0x4E554D4A /* "NUMJ" */
+
+/*
+ * Journal header block: describes one committed transaction of jh_nr
+ * metadata block copies stored in the following journal blocks, one
+ * per block. An all-zero header means the journal is empty.
+ */
+struct numbfs_journal_header {
+	__le32 jh_magic;
+	/* commit sequence number */
+	__le32 jh_seq;
+	/* number of journaled blocks in this transaction */
+	__le32 jh_nr;
+	/* crc32c of the staged copies, proves they are all durable */
+	__le32 jh_csum;
+	/* in-place target block address of each copy */
+	__le32 jh_targets[];
+};
+
+/*
+ * On-disk xattr entry. An inode's xattrs live in a packed region of
+ * contiguous data blocks at i_xattr_start: i_xattr_count entries up
+ * front, then a heap holding each entry's name immediately followed
+ * by its value. e_start is the byte offset of the name from the start
+ * of the region, so the whole set typically loads with a single block
+ * read.
+ */
 struct numbfs_xattr_entry {
 	__u8 e_valid;
 	__le16 e_name_len;
@@ -88,6 +171,8 @@ static inline void numbfs_check_ondisk(void)
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_super_block) != 128);
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_inode) != 64);
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_dirent) != 64);
+	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_cdirent) != 6);
+	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_xattr_entry) != 8);
 }
 
 #endif
@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#define _GNU_SOURCE
+#include "internal.h"
+#include "numbfs_config.h"
+#include "disk.h"
+#include <getopt.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"stats", no_argument, NULL, 's'},
+        {0, 0, 0, 0}
+};
+
+static bool stats;
+
+static void numbfs_help_info(void)
+{
+        printf(
+                "Usage: [OPTIONS] SOURCE DEST\n"
+                "Clone a NumbFS image, copying only the allocated blocks.\n"
+                "\n"
+                "Gerneral options:\n"
+                " --help                display this help information and exit\n"
+                " --stats               print I/O and allocation counters at exit\n"
+        );
+}
+
+static inline bool numbfs_dump_bit(char *bitmap, int nr)
+{
+        return bitmap[nr / BITS_PER_BYTE] & (1 << (nr % BITS_PER_BYTE));
+}
+
+/* copy the raw blocks [blkno, blkno + nblocks) in large chunks */
+static int numbfs_dump_copy(struct numbfs_superblock_info *sbi, int dst,
+                            char *chunk, int blkno, int nblocks)
+{
+        int i, n, err;
+        ssize_t ret;
+
+        for (i = 0; i < nblocks; i += n) {
+                n = min(nblocks - i, NUMBFS_IO_CHUNK_BLOCKS);
+                err = numbfs_read_blocks(sbi, chunk, blkno + i, n);
+                if (err)
+                        return err;
+                ret = pwrite(dst, chunk, (size_t)n * sbi->block_size,
+                             (off_t)(blkno + i) * sbi->block_size);
+                if (ret != (ssize_t)n * sbi->block_size)
+                        return -EIO;
+        }
+        return 0;
+}
+
+/*
+ * Stream the image into a sparse copy: the metadata zones are copied
+ * wholesale, then the block bitmap drives the data zone so only
+ * allocated blocks travel, coalesced into large sequential transfers.
+ * Untouched ranges stay holes in the destination.
+ */
+static int numbfs_dump(struct numbfs_superblock_info *sbi, int dst)
+{
+        int bbm_blocks = sbi->data_start - sbi->bbitmap_start;
+        int i, run, copied = 0, err;
+        char *bbm = NULL, *chunk = NULL;
+
+        err = ftruncate(dst, (off_t)sbi->size);
+        if (err) {
+                fprintf(stderr, "error: failed to size the destination\n");
+                return -errno;
+        }
+        /* a rewritten destination must not keep stale allocated blocks */
+        (void)fallocate(dst, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        0, (off_t)sbi->size);
+
+        bbm = numbfs_balloc(sbi, (size_t)bbm_blocks * sbi->block_size);
+        chunk = numbfs_balloc(sbi, (size_t)NUMBFS_IO_CHUNK_BLOCKS *
+                                   sbi->block_size);
+        if (!bbm || !chunk) {
+                err = -ENOMEM;
+                goto exit;
+        }
+
+        err = numbfs_read_blocks(sbi, bbm, sbi->bbitmap_start, bbm_blocks);
+        if (err)
+                goto exit;
+
+        /* everything before the data zone is metadata, copy it all */
+        err = numbfs_dump_copy(sbi, dst, chunk, 0, sbi->data_start);
+        if (err)
+                goto exit;
+
+        /* allocated data blocks only, coalesced into sequential runs */
+        for (i = 0; i < sbi->data_blocks; i += run ? run : 1) {
+                for (run = 0; i + run < sbi->data_blocks &&
+                              numbfs_dump_bit(bbm, i + run); run++)
+                        ;
+                if (!run)
+                        continue;
+                err = numbfs_dump_copy(sbi, dst, chunk,
+                                       sbi->data_start + i, run);
+                if (err)
+                        goto exit;
+                copied += run;
+        }
+
+        err = fdatasync(dst);
+        if (err) {
+                err = -errno;
+                goto exit;
+        }
+
+        printf("dump: copied %d metadata blocks and %d of %d data blocks\n",
+               sbi->data_start, copied, sbi->data_blocks);
+        err = 0;
+exit:
+        numbfs_bfree(sbi, bbm);
+        numbfs_bfree(sbi, chunk);
+        return err;
+}
+
+int main(int argc, char **argv)
+{
+        struct numbfs_superblock_info sbi = {0};
+        int opt, src = -1, dst = -1, err;
+        char *env = getenv("NUMBFS_STATS");
+        struct stat st;
+
+        if (env && atoi(env))
+                stats = true;
+
+        while ((opt = getopt_long(argc, argv, "hs", long_options, NULL)) != -1) {
+                switch (opt) {
+                        case 'h':
+                                numbfs_help_info();
+                                exit(0);
+                        case 's':
+                                stats = true;
+                                break;
+                        default:
+                                fprintf(stderr, "Error: unknown option\n");
+                                return -EINVAL;
+                }
+        }
+
+        if (optind + 2 != argc) {
+                fprintf(stderr, "Error: missing SOURCE or DEST\n");
+                numbfs_help_info();
+                return -EINVAL;
+        }
+
+        src = open(argv[optind], O_RDONLY);
+        if (src < 0) {
+                fprintf(stderr, "error: failed to open %s\n", argv[optind]);
+                return -errno;
+        }
+
+        err = numbfs_get_superblock(&sbi, src);
+        if (err) {
+                fprintf(stderr, "error: failed to get the superblock, err: %d\n",
+                        err);
+                goto exit;
+        }
+
+        if (fstat(src, &st)) {
+                err = -errno;
+                goto exit;
+        }
+        sbi.size = st.st_size;
+        /* block devices report no size, fall back to the layout */
+        if (!sbi.size)
+                sbi.size = (long long)(sbi.data_start + sbi.data_blocks) *
+                                sbi.block_size;
+
+        dst = open(argv[optind + 1], O_RDWR | O_CREAT, 0644);
+        if (dst < 0) {
+                fprintf(stderr, "error: failed to open %s\n",
+                        argv[optind + 1]);
+                err = -errno;
+                goto exit;
+        }
+
+        err = numbfs_dump(&sbi, dst);
+        if (err)
+                fprintf(stderr, "Error occured in dump, err: %d\n", err);
+exit:
+        if (numbfs_bitmap_release(&sbi))
+                fprintf(stderr, "error: failed to flush bitmaps\n");
+        if (numbfs_cache_destroy(&sbi))
+                fprintf(stderr, "error: failed to flush block cache\n");
+        numbfs_pool_release(&sbi);
+        if (src >= 0)
+                close(src);
+        if (dst >= 0)
+                close(dst);
+        if (stats)
+                numbfs_stats_dump();
+        return err;
+}
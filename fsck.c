@@ -3,33 +3,191 @@
  * Copyright (C) 2025, Hongzhen Luo
  */
 
+#define _GNU_SOURCE
 #include "internal.h"
 #include "disk.h"
 #include <getopt.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <time.h>
 
 static struct option long_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"inodes", no_argument, NULL, 'i'},
         {"blocks", no_argument, NULL, 'b'},
         {"nid", required_argument, NULL, 'n'},
+        {"uring", optional_argument, NULL, 'u'},
+        {"threads", required_argument, NULL, 't'},
+        {"check", no_argument, NULL, 'c'},
+        {"direct", no_argument, NULL, 4},
+        {"fast", no_argument, NULL, 5},
+        {"xattrs", no_argument, NULL, 6},
+        {"scrub", no_argument, NULL, 7},
+        {"format", required_argument, NULL, 'f'},
+        {"stats", no_argument, NULL, 's'},
         {0, 0, 0, 0}
 };
 
+enum {
+        NUMBFS_FMT_TEXT,
+        NUMBFS_FMT_JSON,
+        NUMBFS_FMT_BINARY,
+};
+
 struct numbfs_fsck_cfg {
         bool show_inodes;
         bool show_blocks;
+        bool check;
+        bool direct;
+        bool fast;
+        bool xattrs;
+        bool scrub;
+        bool stats;
+        int format;
         int nid;
+        int uring_depth;
+        int threads;
         char *dev;
 };
 
+/*
+ * Buffered report emitter: all report output is formatted into one
+ * large buffer and pushed to stdout in NUMBFS_EMIT_BUFSZ writes, so
+ * dumping a big directory is bounded by I/O rather than a stdio
+ * round trip per line.
+ */
+#define NUMBFS_EMIT_BUFSZ       (1 << 20)
+
+static struct {
+        int format;
+        int pos;
+        /* no separator needed before the next JSON array member */
+        bool first;
+        char buf[NUMBFS_EMIT_BUFSZ];
+} emitter;
+
+static void numbfs_emit_flush(void)
+{
+        int off = 0;
+        ssize_t n;
+
+        while (off < emitter.pos) {
+                n = write(STDOUT_FILENO, emitter.buf + off,
+                          emitter.pos - off);
+                if (n < 0) {
+                        fprintf(stderr, "error: failed to write report\n");
+                        exit(1);
+                }
+                off += n;
+        }
+        emitter.pos = 0;
+}
+
+static void numbfs_emit_raw(const void *data, int len)
+{
+        if (emitter.pos + len > NUMBFS_EMIT_BUFSZ)
+                numbfs_emit_flush();
+        memcpy(emitter.buf + emitter.pos, data, len);
+        emitter.pos += len;
+}
+
+static void numbfs_emit(const char *fmt, ...)
+{
+        va_list ap;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(emitter.buf + emitter.pos,
+                      NUMBFS_EMIT_BUFSZ - emitter.pos, fmt, ap);
+        va_end(ap);
+        if (n >= NUMBFS_EMIT_BUFSZ - emitter.pos) {
+                numbfs_emit_flush();
+                va_start(ap, fmt);
+                n = vsnprintf(emitter.buf, NUMBFS_EMIT_BUFSZ, fmt, ap);
+                va_end(ap);
+        }
+        emitter.pos += n;
+}
+
+/* separate JSON array members; only one array is open at a time */
+static void numbfs_emit_sep(void)
+{
+        if (!emitter.first)
+                numbfs_emit(",");
+        emitter.first = false;
+}
+
+/* emit a JSON string, escaping quotes, backslashes and controls */
+static void numbfs_emit_json_str(const char *s)
+{
+        numbfs_emit("\"");
+        for (; *s; s++) {
+                if (*s == '"' || *s == '\\')
+                        numbfs_emit("\\%c", *s);
+                else if ((unsigned char)*s < 0x20)
+                        numbfs_emit("\\u%04x", *s);
+                else
+                        numbfs_emit("%c", *s);
+        }
+        numbfs_emit("\"");
+}
+
+/* binary mode: 4-byte magic, then u8 type + le16 length + payload */
+#define NUMBFS_REC_MAGIC        "NBFK"
+
+enum {
+        NUMBFS_REC_SUPER = 1,
+        NUMBFS_REC_USAGE,
+        NUMBFS_REC_INODE,
+        NUMBFS_REC_DIRENT,
+        NUMBFS_REC_BAD,
+        NUMBFS_REC_SUMMARY,
+        NUMBFS_REC_XATTR,
+        NUMBFS_REC_SCRUB,
+};
+
+static void numbfs_emit_rec(int type, const void *payload, int len)
+{
+        __u8 hdr[3];
+
+        hdr[0] = type;
+        hdr[1] = len & 0xff;
+        hdr[2] = len >> 8;
+        numbfs_emit_raw(hdr, sizeof(hdr));
+        numbfs_emit_raw(payload, len);
+}
+
+/* report one inconsistency found by --check in the selected format */
+static void numbfs_fsck_report(const char *fmt, ...)
+{
+        char msg[256];
+        va_list ap;
+
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                numbfs_emit("[inconsistency] %s\n", msg);
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit_sep();
+                numbfs_emit_json_str(msg);
+                break;
+        case NUMBFS_FMT_BINARY:
+                numbfs_emit_rec(NUMBFS_REC_BAD, msg, strlen(msg));
+                break;
+        }
+}
+
 static void numbfs_fsck_help(void)
 {
         printf(
@@ -41,6 +199,15 @@ static void numbfs_fsck_help(void)
                 " --inodes|-i           display inode usage\n"
                 " --blocks|-b           display block usage\n"
                 " --nid=X               display the inode information of inode@nid\n"
+                " --uring[=#]           use io_uring with the given queue depth (default: 32)\n"
+                " --threads=N|-t N      scan the bitmap zones with N worker threads\n"
+                " --check|-c            cross-check inodes, dirents and the block bitmap\n"
+                " --direct              open the device with O_DIRECT, bypassing the page cache\n"
+                " --fast                reuse cached results from DEV.fsck when nothing changed\n"
+                " --xattrs              display extended attributes (all inodes, or --nid's)\n"
+                " --scrub               read the whole device sequentially, verifying metadata en route\n"
+                " --format=FMT|-f FMT   report format: text (default), json or binary\n"
+                " --stats|-s            print I/O and allocation counters at exit\n"
         );
 }
 
@@ -48,7 +215,12 @@ static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg
 {
         int opt;
 
-        while ((opt = getopt_long(argc, argv, "n:hib", long_options, NULL)) != -1) {
+        char *env = getenv("NUMBFS_STATS");
+
+        if (env && atoi(env))
+                cfg->stats = true;
+
+        while ((opt = getopt_long(argc, argv, "n:t:f:hibcs", long_options, NULL)) != -1) {
                 switch(opt) {
                         case 'h':
                                 numbfs_fsck_help();
@@ -59,9 +231,54 @@ static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg
                         case 'b':
                                 cfg->show_blocks = true;
                                 break;
+                        case 'c':
+                                cfg->check = true;
+                                break;
+                        case 4:
+                                cfg->direct = true;
+                                break;
+                        case 5:
+                                cfg->fast = true;
+                                break;
+                        case 6:
+                                cfg->xattrs = true;
+                                break;
+                        case 7:
+                                cfg->scrub = true;
+                                break;
+                        case 's':
+                                cfg->stats = true;
+                                break;
                         case 'n':
                                 cfg->nid = atoi(optarg);
                                 break;
+                        case 'f':
+                                if (!strcmp(optarg, "text")) {
+                                        cfg->format = NUMBFS_FMT_TEXT;
+                                } else if (!strcmp(optarg, "json")) {
+                                        cfg->format = NUMBFS_FMT_JSON;
+                                } else if (!strcmp(optarg, "binary")) {
+                                        cfg->format = NUMBFS_FMT_BINARY;
+                                } else {
+                                        fprintf(stderr, "error: unknown format: %s\n", optarg);
+                                        exit(1);
+                                }
+                                break;
+                        case 'u':
+                                cfg->uring_depth = optarg ? atoi(optarg) :
+                                                NUMBFS_IOU_DEPTH;
+                                if (cfg->uring_depth <= 0) {
+                                        fprintf(stderr, "error: invalid uring queue depth\n");
+                                        exit(1);
+                                }
+                                break;
+                        case 't':
+                                cfg->threads = atoi(optarg);
+                                if (cfg->threads <= 0) {
+                                        fprintf(stderr, "error: invalid thread count\n");
+                                        exit(1);
+                                }
+                                break;
                         default:
                                 fprintf(stderr, "Unknown option: %s\n\n", argv[optind - 1]);
                                 numbfs_fsck_help();
@@ -81,26 +298,6 @@ static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg
         }
 }
 
-static int count_bit(__u8 byte)
-{
-        int ret = 0, i;
-
-        for (i = 0; i < 8; i ++) {
-                ret += (byte & 1);
-                byte >>= 1;
-        }
-        return ret;
-}
-
-static int numbfs_fsck_used(char *buf)
-{
-        int i, ret = 0;
-
-        for (i = 0; i < BYTES_PER_BLOCK; i++)
-                ret += count_bit(buf[i]);
-        return ret;
-}
-
 static inline char *numbfs_dir_type(int type)
 {
         if (type == DT_DIR)
@@ -116,9 +313,9 @@ static int numbfs_fsck_show_inode(struct numbfs_superblock_info *sbi,
                                   int nid)
 {
         struct numbfs_inode_info *inode_i;
+        struct numbfs_dir_iter it;
         struct numbfs_dirent *dir;
-        char buf[BYTES_PER_BLOCK];
-        int err, i;
+        int err;
 
 
         inode_i = malloc(sizeof(*inode_i));
@@ -133,106 +330,1004 @@ static int numbfs_fsck_show_inode(struct numbfs_superblock_info *sbi,
                 goto exit;
         }
 
-        printf("================================\n");
-        printf("Inode Information\n");
-        printf("    inode number:               %d\n", nid);
-        if (S_ISDIR(inode_i->mode))
-                printf("    inode type:                 DIR\n");
-        else if (S_ISLNK(inode_i->mode))
-                printf("    inode type:                 SYMLINK\n");
-        else
-                printf("    inode type:                 REGULAR FILE\n");
-        printf("    link count:                 %d\n", inode_i->nlink);
-        printf("    inode uid:                  %d\n", inode_i->uid);
-        printf("    inode gid:                  %d\n", inode_i->gid);
-        printf("    inode size:                 %d\n\n", inode_i->size);
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                numbfs_emit("================================\n");
+                numbfs_emit("Inode Information\n");
+                numbfs_emit("    inode number:               %d\n", nid);
+                if (S_ISDIR(inode_i->mode))
+                        numbfs_emit("    inode type:                 DIR\n");
+                else if (S_ISLNK(inode_i->mode))
+                        numbfs_emit("    inode type:                 SYMLINK\n");
+                else
+                        numbfs_emit("    inode type:                 REGULAR FILE\n");
+                numbfs_emit("    link count:                 %d\n", inode_i->nlink);
+                numbfs_emit("    inode uid:                  %d\n", inode_i->uid);
+                numbfs_emit("    inode gid:                  %d\n", inode_i->gid);
+                numbfs_emit("    inode size:                 %d\n\n", inode_i->size);
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit(",\"inode\":{\"nid\":%d,\"mode\":%d,\"nlink\":%d,"
+                            "\"uid\":%d,\"gid\":%d,\"size\":%d",
+                            nid, inode_i->mode, inode_i->nlink,
+                            inode_i->uid, inode_i->gid, inode_i->size);
+                break;
+        case NUMBFS_FMT_BINARY: {
+                __le32 v[6];
+
+                v[0] = cpu_to_le32(nid);
+                v[1] = cpu_to_le32(inode_i->mode);
+                v[2] = cpu_to_le32(inode_i->nlink);
+                v[3] = cpu_to_le32(inode_i->uid);
+                v[4] = cpu_to_le32(inode_i->gid);
+                v[5] = cpu_to_le32(inode_i->size);
+                numbfs_emit_rec(NUMBFS_REC_INODE, v, sizeof(v));
+                break;
+        }
+        }
 
         if (S_ISDIR(inode_i->mode)) {
-                printf("    DIR CONTENT\n");
-                for (i = 0; i < inode_i->size; i += sizeof(struct numbfs_dirent)) {
-                        if (i % BYTES_PER_BLOCK == 0) {
-                                err = numbfs_pread_inode(inode_i, buf, i, BYTES_PER_BLOCK);
+                if (emitter.format == NUMBFS_FMT_TEXT)
+                        numbfs_emit("    DIR CONTENT\n");
+                else if (emitter.format == NUMBFS_FMT_JSON) {
+                        numbfs_emit(",\"dirents\":[");
+                        emitter.first = true;
+                }
+                numbfs_dir_iter_init(&it, inode_i);
+                while ((err = numbfs_dir_iter_next(&it)) > 0) {
+                        dir = &it.de;
+                        switch (emitter.format) {
+                        case NUMBFS_FMT_TEXT:
+                                numbfs_emit("       INODE: %05d, TYPE: %s, NAMELEN: %02d NAME: %s\n",
+                                        le16_to_cpu(dir->ino), numbfs_dir_type(dir->type),dir->name_len, dir->name);
+                                break;
+                        case NUMBFS_FMT_JSON:
+                                numbfs_emit_sep();
+                                numbfs_emit("{\"nid\":%d,\"type\":%d,\"name\":",
+                                            le16_to_cpu(dir->ino), dir->type);
+                                numbfs_emit_json_str(dir->name);
+                                numbfs_emit("}");
+                                break;
+                        case NUMBFS_FMT_BINARY: {
+                                /* le16 ino + u8 type + u8 name_len + name */
+                                __u8 rec[4 + NUMBFS_MAX_PATH_LEN];
+
+                                memcpy(rec, &dir->ino, 2);
+                                rec[2] = dir->type;
+                                rec[3] = dir->name_len;
+                                memcpy(rec + 4, dir->name, dir->name_len);
+                                numbfs_emit_rec(NUMBFS_REC_DIRENT, rec,
+                                                4 + dir->name_len);
+                                break;
+                        }
+                        }
+                }
+                if (err < 0) {
+                        fprintf(stderr, "error: failed to walk dirents of inode@%d\n",
+                                nid);
+                        goto exit;
+                }
+                if (emitter.format == NUMBFS_FMT_JSON)
+                        numbfs_emit("]");
+        }
+        if (emitter.format == NUMBFS_FMT_JSON)
+                numbfs_emit("}");
+
+exit:
+        free(inode_i);
+        return err;
+}
+
+/* display the xattrs of inode @nid, or of every allocated inode */
+static int numbfs_fsck_show_xattrs(struct numbfs_superblock_info *sbi,
+                                   int nid)
+{
+        struct numbfs_inode_info inode_i;
+        char names[NUMBFS_MAX_BLOCK_SIZE], value[NUMBFS_MAX_BLOCK_SIZE];
+        int first = nid >= 0 ? nid : 0;
+        int last = nid >= 0 ? nid + 1 : sbi->total_inodes;
+        int n, used, len, vlen, err;
+        char *name;
+
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                numbfs_emit("================================\n");
+                numbfs_emit("Xattr Information\n");
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit(",\"xattrs\":[");
+                emitter.first = true;
+                break;
+        }
+
+        for (n = first; n < last; n++) {
+                inode_i.sbi = sbi;
+                inode_i.nid = n;
+                err = numbfs_get_inode(sbi, &inode_i);
+                if (err)
+                        return err;
+                if (!inode_i.xattr_count)
+                        continue;
+
+                used = numbfs_xattr_list(&inode_i, names, sizeof(names));
+                if (used < 0)
+                        return used;
+
+                for (name = names; name < names + used; name += len + 1) {
+                        len = strlen(name);
+                        vlen = numbfs_xattr_get(&inode_i, name, value,
+                                                sizeof(value) - 1);
+                        if (vlen < 0)
+                                return vlen;
+                        value[vlen] = '\0';
+
+                        switch (emitter.format) {
+                        case NUMBFS_FMT_TEXT:
+                                numbfs_emit("    inode@%d: %s = \"%s\"\n",
+                                            n, name, value);
+                                break;
+                        case NUMBFS_FMT_JSON:
+                                numbfs_emit_sep();
+                                numbfs_emit("{\"nid\":%d,\"name\":", n);
+                                numbfs_emit_json_str(name);
+                                numbfs_emit(",\"value\":");
+                                numbfs_emit_json_str(value);
+                                numbfs_emit("}");
+                                break;
+                        case NUMBFS_FMT_BINARY: {
+                                /* le32 nid + u8 name_len + le16 value_len */
+                                __u8 rec[7 + NUMBFS_MAX_PATH_LEN +
+                                         NUMBFS_MAX_BLOCK_SIZE];
+                                __le32 v = cpu_to_le32(n);
+                                __le16 vl = cpu_to_le16(vlen);
+
+                                memcpy(rec, &v, 4);
+                                rec[4] = len;
+                                memcpy(rec + 5, &vl, 2);
+                                memcpy(rec + 7, name, len);
+                                memcpy(rec + 7 + len, value, vlen);
+                                numbfs_emit_rec(NUMBFS_REC_XATTR, rec,
+                                                7 + len + vlen);
+                                break;
+                        }
+                        }
+                }
+        }
+        if (emitter.format == NUMBFS_FMT_JSON)
+                numbfs_emit("]");
+        return 0;
+}
+
+static inline bool numbfs_fsck_bit(char *bitmap, int nr)
+{
+        return bitmap[nr / BITS_PER_BYTE] & (1 << (nr % BITS_PER_BYTE));
+}
+
+/* cross-check one data block reference of inode @nid */
+static int numbfs_fsck_check_blk(struct numbfs_superblock_info *sbi,
+                                 char *bbm, int *owner, int nid, int blk)
+{
+        if (blk < 0 || blk >= sbi->data_blocks) {
+                numbfs_fsck_report("inode@%d references invalid block %d",
+                                   nid, blk);
+                return 1;
+        }
+        if (!numbfs_fsck_bit(bbm, blk)) {
+                numbfs_fsck_report("block %d of inode@%d is not marked used",
+                                   blk, nid);
+                return 1;
+        }
+        if (owner[blk] >= 0) {
+                numbfs_fsck_report("block %d claimed by both inode@%d and inode@%d",
+                                   blk, owner[blk], nid);
+                return 1;
+        }
+        owner[blk] = nid;
+        return 0;
+}
+
+/*
+ * Full consistency check: build reverse maps (data block -> owning
+ * inode, inode -> dirent reference count) in one streaming pass over
+ * the bitmap and inode zones plus a breadth-first directory walk from
+ * the root, then report cross-reference conflicts.
+ */
+static int numbfs_fsck_check(struct numbfs_superblock_info *sbi)
+{
+        int ibm_blocks = sbi->inode_start - sbi->ibitmap_start;
+        int bbm_blocks = sbi->data_start - sbi->bbitmap_start;
+        char *ibm = NULL, *bbm = NULL, *chunk = NULL, *visited = NULL;
+        int *owner = NULL, *links = NULL, *nlinks = NULL;
+        int *modes = NULL, *queue = NULL;
+        struct numbfs_inode_info dir_i;
+        struct numbfs_dir_iter it;
+        struct numbfs_dirent *dir;
+        int i, j, n, nid, blk, qh, qt, cnt, err;
+        bool repair = false;
+        long long nerr = 0;
+
+        ibm = numbfs_balloc(sbi, (size_t)ibm_blocks * sbi->block_size);
+        bbm = numbfs_balloc(sbi, (size_t)bbm_blocks * sbi->block_size);
+        chunk = numbfs_balloc(sbi, (size_t)NUMBFS_IO_CHUNK_BLOCKS *
+                                   sbi->block_size);
+        owner = malloc(sbi->data_blocks * sizeof(int));
+        links = calloc(sbi->total_inodes, sizeof(int));
+        nlinks = calloc(sbi->total_inodes, sizeof(int));
+        modes = calloc(sbi->total_inodes, sizeof(int));
+        queue = malloc(sbi->total_inodes * sizeof(int));
+        visited = calloc(sbi->total_inodes, 1);
+        if (!ibm || !bbm || !chunk || !owner || !links || !nlinks ||
+            !modes || !queue || !visited) {
+                err = -ENOMEM;
+                goto exit;
+        }
+
+        err = numbfs_read_blocks(sbi, ibm, sbi->ibitmap_start, ibm_blocks);
+        if (err)
+                goto exit;
+        err = numbfs_read_blocks(sbi, bbm, sbi->bbitmap_start, bbm_blocks);
+        if (err)
+                goto exit;
+        for (i = 0; i < sbi->data_blocks; i++)
+                owner[i] = -1;
+
+        if (emitter.format == NUMBFS_FMT_JSON) {
+                numbfs_emit(",\"check\":{\"inconsistencies\":[");
+                emitter.first = true;
+        }
+
+        /* pass 0: whole-zone checksum verification */
+        if (sbi->feature & NUMBFS_FEATURE_CSUM) {
+                const struct {
+                        const char *name;
+                        int start, end;
+                        unsigned int want;
+                } zones[] = {
+                        { "inode bitmap", sbi->ibitmap_start,
+                          sbi->inode_start, sbi->ibitmap_csum },
+                        { "inode table", sbi->inode_start,
+                          sbi->bbitmap_start, sbi->itable_csum },
+                        { "block bitmap", sbi->bbitmap_start,
+                          sbi->data_start, sbi->bbitmap_csum },
+                };
+                unsigned int k;
+                __u32 crc;
+
+                for (k = 0; k < sizeof(zones) / sizeof(zones[0]); k++) {
+                        err = numbfs_csum_zone(sbi, zones[k].start,
+                                               zones[k].end - zones[k].start,
+                                               &crc);
+                        if (err)
+                                goto exit;
+                        if (crc != zones[k].want) {
+                                numbfs_fsck_report("%s zone checksum mismatch (stored %08x, computed %08x)",
+                                                   zones[k].name,
+                                                   zones[k].want, crc);
+                                nerr++;
+                        }
+                }
+        }
+
+        /*
+         * The superblock counters are only updated in batch at bitmap
+         * flush time, so a crash leaves them stale: recompute them
+         * from the bitmaps and repair the superblock if they differ.
+         */
+        err = numbfs_popcount_range(sbi, sbi->ibitmap_start, ibm_blocks,
+                                    &cnt);
+        if (err)
+                goto exit;
+        if (cnt != sbi->total_inodes - sbi->free_inodes) {
+                numbfs_fsck_report("superblock records %d free inodes but the bitmap has %d, repaired",
+                                   sbi->free_inodes,
+                                   sbi->total_inodes - cnt);
+                sbi->free_inodes = sbi->total_inodes - cnt;
+                repair = true;
+                nerr++;
+        }
+        err = numbfs_popcount_range(sbi, sbi->bbitmap_start, bbm_blocks,
+                                    &cnt);
+        if (err)
+                goto exit;
+        if (cnt != sbi->data_blocks - sbi->free_blocks) {
+                numbfs_fsck_report("superblock records %d free blocks but the bitmap has %d, repaired",
+                                   sbi->free_blocks,
+                                   sbi->data_blocks - cnt);
+                sbi->free_blocks = sbi->data_blocks - cnt;
+                repair = true;
+                nerr++;
+        }
+        if (repair) {
+                err = numbfs_sync_superblock(sbi);
+                if (err)
+                        goto exit;
+        }
+
+        /* pass 1: stream the inode table, map every block to its owner */
+        for (i = sbi->inode_start; i < sbi->bbitmap_start; i += n) {
+                struct numbfs_inode *inode;
+
+                n = min(sbi->bbitmap_start - i, NUMBFS_IO_CHUNK_BLOCKS);
+                err = numbfs_read_blocks(sbi, chunk, i, n);
+                if (err)
+                        goto exit;
+
+                for (j = 0; j < n * numbfs_nodes_per_blk(sbi); j++) {
+                        nid = (i - sbi->inode_start) *
+                                        numbfs_nodes_per_blk(sbi) + j;
+                        if (nid >= sbi->total_inodes)
+                                break;
+                        if (!numbfs_fsck_bit(ibm, nid))
+                                continue;
+
+                        inode = ((struct numbfs_inode*)chunk) + j;
+                        nlinks[nid] = le16_to_cpu(inode->i_nlink);
+                        modes[nid] = le32_to_cpu(inode->i_mode);
+
+                        if (inode->i_xattr_count) {
+                                int xstart = le32_to_cpu(inode->i_xattr_start);
+                                int b, xblks;
+
+                                xblks = numbfs_xattr_blocks(sbi, xstart,
+                                                inode->i_xattr_count);
+                                if (xblks < 0) {
+                                        numbfs_fsck_report("inode@%d has a corrupted xattr region",
+                                                           nid);
+                                        nerr++;
+                                } else {
+                                        for (b = 0; b < xblks; b++)
+                                                nerr += numbfs_fsck_check_blk(sbi,
+                                                        bbm, owner, nid,
+                                                        xstart + b);
+                                }
+                        }
+
+                        /* inline inodes reference no data blocks */
+                        if ((sbi->feature & NUMBFS_FEATURE_INLINE) &&
+                            (inode->i_flags & NUMBFS_I_INLINE))
+                                continue;
+
+                        if (sbi->feature & NUMBFS_FEATURE_EXTENT) {
+                                int k, start, len;
+
+                                for (k = 0; k < NUMBFS_EXTENT_ENTRIES; k++) {
+                                        start = (int)le32_to_cpu(inode->i_data[2 * k]);
+                                        len = (int)le32_to_cpu(inode->i_data[2 * k + 1]);
+                                        if (len <= 0)
+                                                break;
+                                        for (blk = start; blk < start + len; blk++)
+                                                nerr += numbfs_fsck_check_blk(sbi,
+                                                        bbm, owner, nid, blk);
+                                }
+                        } else {
+                                int k;
+
+                                for (k = 0; k < NUMBFS_NUM_DATA_ENTRY; k++) {
+                                        blk = (int)le32_to_cpu(inode->i_data[k]);
+                                        if (blk == NUMBFS_HOLE)
+                                                continue;
+                                        nerr += numbfs_fsck_check_blk(sbi,
+                                                bbm, owner, nid, blk);
+                                }
+                        }
+                }
+        }
+
+        /* pass 2: walk the directory tree, count dirent references */
+        qh = qt = 0;
+        queue[qt++] = NUMBFS_ROOT_NID;
+        visited[NUMBFS_ROOT_NID] = 1;
+        while (qh < qt) {
+                dir_i.nid = queue[qh++];
+                dir_i.sbi = sbi;
+                err = numbfs_get_inode(sbi, &dir_i);
+                if (err)
+                        goto exit;
+                if (!S_ISDIR(dir_i.mode))
+                        continue;
+
+                numbfs_dir_iter_init(&it, &dir_i);
+                while ((err = numbfs_dir_iter_next(&it)) > 0) {
+                        dir = &it.de;
+                        nid = le16_to_cpu(dir->ino);
+                        if (nid >= sbi->total_inodes ||
+                            !numbfs_fsck_bit(ibm, nid)) {
+                                numbfs_fsck_report("dirent '%s' in inode@%d references unallocated inode %d",
+                                                   dir->name, dir_i.nid, nid);
+                                nerr++;
+                                continue;
+                        }
+                        links[nid]++;
+                        if (dir->type == DT_DIR && !visited[nid]) {
+                                visited[nid] = 1;
+                                queue[qt++] = nid;
+                        }
+                }
+                if (err)
+                        goto exit;
+        }
+
+        /* orphans and bad link counts */
+        for (nid = 0; nid < sbi->total_inodes; nid++) {
+                if (!numbfs_fsck_bit(ibm, nid))
+                        continue;
+                if (!links[nid] && nid != NUMBFS_ROOT_NID) {
+                        numbfs_fsck_report("inode@%d is allocated but has no dirent",
+                                           nid);
+                        nerr++;
+                } else if (links[nid] != nlinks[nid]) {
+                        numbfs_fsck_report("inode@%d has %d links but nlink is %d",
+                                           nid, links[nid], nlinks[nid]);
+                        nerr++;
+                }
+        }
+
+        err = nerr ? -EINVAL : 0;
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                if (nerr)
+                        numbfs_emit("check: %lld inconsistencies found\n", nerr);
+                else
+                        numbfs_emit("check: no inconsistencies found\n");
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit("],\"count\":%lld}", nerr);
+                break;
+        case NUMBFS_FMT_BINARY: {
+                __le32 cnt = cpu_to_le32(nerr);
+
+                numbfs_emit_rec(NUMBFS_REC_SUMMARY, &cnt, sizeof(cnt));
+                break;
+        }
+        }
+exit:
+        numbfs_bfree(sbi, ibm);
+        numbfs_bfree(sbi, bbm);
+        numbfs_bfree(sbi, chunk);
+        free(owner);
+        free(links);
+        free(nlinks);
+        free(modes);
+        free(queue);
+        free(visited);
+        return err;
+}
+
+
+/*
+ * --scrub: read the entire device once in large sequential chunks to
+ * surface latent sector errors before they bite. Reads go straight to
+ * the device instead of through the block cache or mapping so every
+ * block actually travels the wire, and the chunk size keeps the run
+ * at disk bandwidth rather than one block per syscall. Metadata zones
+ * are validated as they stream past: the superblock magic, the zone
+ * checksums when NUMBFS_FEATURE_CSUM is set, and every in-use inode
+ * slot carrying its own inode number.
+ */
+#define NUMBFS_SCRUB_CHUNK      (8 << 20)
+
+static int numbfs_scrub_pread(struct numbfs_superblock_info *sbi, char *buf,
+                              int blkno, int count)
+{
+        ssize_t ret;
+
+        numbfs_stats.syscalls++;
+        numbfs_stats.blocks_read += count;
+        numbfs_stats.bytes_read += (long long)count * sbi->block_size;
+        ret = pread(sbi->fd, buf, (size_t)count * sbi->block_size,
+                    (off_t)blkno * sbi->block_size);
+        if (ret != (ssize_t)count * sbi->block_size)
+                return -EIO;
+        return 0;
+}
+
+static int numbfs_fsck_scrub(struct numbfs_superblock_info *sbi)
+{
+        struct {
+                const char *name;
+                int start, end;
+                unsigned int want;
+                __u32 crc;
+                bool ok;
+        } zones[] = {
+                { "inode bitmap", sbi->ibitmap_start, sbi->inode_start,
+                  sbi->ibitmap_csum, 0, true },
+                { "inode table", sbi->inode_start, sbi->bbitmap_start,
+                  sbi->itable_csum, 0, true },
+                { "block bitmap", sbi->bbitmap_start, sbi->data_start,
+                  sbi->bbitmap_csum, 0, true },
+        };
+        int total = sbi->data_start + sbi->data_blocks;
+        int cpb = NUMBFS_SCRUB_CHUNK / sbi->block_size;
+        int i, j, k, n, m, lo, hi, nid, first, err;
+        struct timespec t0, t1;
+        long long nerr = 0;
+        char *chunk;
+        unsigned int z;
+        double secs;
+
+        /* O_DIRECT reads must stay aligned when narrowing a failure */
+        int step = sbi->direct ?
+                        max(NUMBFS_DIRECT_ALIGN / sbi->block_size, 1) : 1;
+
+        chunk = numbfs_balloc(sbi, (size_t)cpb * sbi->block_size);
+        if (!chunk)
+                return -ENOMEM;
+
+        /* raw reads must not race dirty blocks held in the cache */
+        err = numbfs_cache_flush(sbi);
+        if (err)
+                goto exit;
+
+        if (emitter.format == NUMBFS_FMT_JSON) {
+                numbfs_emit(",\"scrub\":{\"errors\":[");
+                emitter.first = true;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < total; i += n) {
+                n = min(total - i, cpb);
+                err = numbfs_scrub_pread(sbi, chunk, i, n);
+                if (err) {
+                        /* narrow the failure down to unreadable runs */
+                        first = -1;
+                        for (j = 0; j < n; j += m) {
+                                m = min(step, n - j);
+                                err = numbfs_scrub_pread(sbi, chunk +
+                                                (size_t)j * sbi->block_size,
+                                                i + j, m);
                                 if (err) {
-                                        fprintf(stderr, "error: failed to read block@%d of inode@%d\n",
-                                                i / BYTES_PER_BLOCK, nid);
-                                        goto exit;
+                                        memset(chunk + (size_t)j *
+                                               sbi->block_size, 0,
+                                               (size_t)m * sbi->block_size);
+                                        for (z = 0; z < sizeof(zones) /
+                                                    sizeof(zones[0]); z++)
+                                                if (i + j < zones[z].end &&
+                                                    i + j + m > zones[z].start)
+                                                        zones[z].ok = false;
+                                        if (first < 0)
+                                                first = i + j;
+                                        continue;
+                                }
+                                if (first >= 0) {
+                                        numbfs_fsck_report("blocks %d..%d are unreadable",
+                                                           first, i + j - 1);
+                                        nerr += i + j - first;
+                                        first = -1;
+                                }
+                        }
+                        if (first >= 0) {
+                                numbfs_fsck_report("blocks %d..%d are unreadable",
+                                                   first, i + n - 1);
+                                nerr += i + n - first;
+                        }
+                        err = 0;
+                }
+
+                /* validate whatever metadata streamed past */
+                if (i <= 1 && 1 < i + n) {
+                        struct numbfs_super_block *sb = (void *)(chunk +
+                                        (size_t)(1 - i) * sbi->block_size);
+
+                        if (le32_to_cpu(sb->s_magic) != NUMBFS_MAGIC) {
+                                numbfs_fsck_report("superblock magic mismatch (found %08x)",
+                                                   le32_to_cpu(sb->s_magic));
+                                nerr++;
+                        }
+                }
+
+                for (z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+                        lo = max(i, zones[z].start);
+                        hi = min(i + n, zones[z].end);
+                        if (lo < hi)
+                                zones[z].crc = numbfs_crc32c(zones[z].crc,
+                                        chunk + (size_t)(lo - i) * sbi->block_size,
+                                        (size_t)(hi - lo) * sbi->block_size);
+                }
+
+                /* in-use inode slots must carry their own number */
+                lo = max(i, sbi->inode_start);
+                hi = min(i + n, sbi->bbitmap_start);
+                for (j = lo; j < hi; j++) {
+                        struct numbfs_inode *di = (void *)(chunk +
+                                        (size_t)(j - i) * sbi->block_size);
+
+                        for (k = 0; k < numbfs_nodes_per_blk(sbi); k++) {
+                                nid = (j - sbi->inode_start) *
+                                                numbfs_nodes_per_blk(sbi) + k;
+                                if (nid >= sbi->total_inodes)
+                                        break;
+                                if (!di[k].i_nlink)
+                                        continue;
+                                if (le16_to_cpu(di[k].i_ino) != nid) {
+                                        numbfs_fsck_report("inode@%d has i_ino %d",
+                                                           nid,
+                                                           le16_to_cpu(di[k].i_ino));
+                                        nerr++;
                                 }
                         }
-                        dir = (struct numbfs_dirent*)&buf[i % BYTES_PER_BLOCK];
-                        printf("       INODE: %05d, TYPE: %s, NAMELEN: %02d NAME: %s\n",
-                                le16_to_cpu(dir->ino), numbfs_dir_type(dir->type),dir->name_len, dir->name);
                 }
         }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (sbi->feature & NUMBFS_FEATURE_CSUM) {
+                for (z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+                        if (!zones[z].ok || zones[z].crc == zones[z].want)
+                                continue;
+                        numbfs_fsck_report("%s zone checksum mismatch (stored %08x, computed %08x)",
+                                           zones[z].name, zones[z].want,
+                                           zones[z].crc);
+                        nerr++;
+                }
+        }
+
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (secs <= 0)
+                secs = 1e-9;
+        err = nerr ? -EINVAL : 0;
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                numbfs_emit("scrub: read %d blocks (%.1f MB) in %.2fs, %.1f MB/s, %lld errors\n",
+                            total,
+                            (double)total * sbi->block_size / 1e6, secs,
+                            (double)total * sbi->block_size / 1e6 / secs,
+                            nerr);
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit("],\"blocks\":%d,\"mb_per_sec\":%.1f,\"count\":%lld}",
+                            total,
+                            (double)total * sbi->block_size / 1e6 / secs,
+                            nerr);
+                break;
+        case NUMBFS_FMT_BINARY: {
+                /* le32 blocks read + le32 MB/s + le32 error count */
+                __le32 v[3];
 
+                v[0] = cpu_to_le32(total);
+                v[1] = cpu_to_le32((__u32)((double)total * sbi->block_size /
+                                           1e6 / secs));
+                v[2] = cpu_to_le32((__u32)nerr);
+                numbfs_emit_rec(NUMBFS_REC_SCRUB, v, sizeof(v));
+                break;
+        }
+        }
 exit:
-        free(inode_i);
+        numbfs_bfree(sbi, chunk);
         return err;
 }
 
+/*
+ * --fast sidecar state: after a full run the usage counts are stored
+ * in DEV.fsck together with a digest of the superblock and bitmap
+ * zones; a later --fast run whose digest still matches reuses the
+ * stored counts instead of rescanning. Only the usage scans are
+ * cached: a --check verdict also depends on the inode table and the
+ * dirent blocks, which the digest does not cover.
+ */
+#define NUMBFS_STATE_MAGIC      0x4E424653 /* "NBFS" */
+
+#define NUMBFS_STATE_INODES     0x1 /* st_inodes_used is valid */
+#define NUMBFS_STATE_BLOCKS     0x2 /* st_blocks_used is valid */
+
+struct numbfs_fsck_state {
+        __le32 st_magic;
+        __le32 st_flags;
+        __le64 st_digest;
+        __le32 st_inodes_used;
+        __le32 st_blocks_used;
+};
+
+/* FNV-1a, folded over the superblock block and both bitmap zones */
+static unsigned long long numbfs_fsck_fold(unsigned long long h,
+                                           const void *buf, size_t len)
+{
+        const unsigned char *p = buf;
+
+        while (len--) {
+                h ^= *p++;
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+static int numbfs_fsck_digest(struct numbfs_superblock_info *sbi,
+                              unsigned long long *digest)
+{
+        unsigned long long h = 0xcbf29ce484222325ULL;
+        char buf[NUMBFS_MAX_BLOCK_SIZE];
+        char *chunk;
+        int i, n, err = 0;
+
+        err = numbfs_read_block(sbi, buf, 1);
+        if (err)
+                return err;
+        h = numbfs_fsck_fold(h, buf, sbi->block_size);
+
+        chunk = numbfs_balloc(sbi, (size_t)NUMBFS_IO_CHUNK_BLOCKS *
+                                   sbi->block_size);
+        if (!chunk)
+                return -ENOMEM;
+        for (i = sbi->ibitmap_start; i < sbi->inode_start; i += n) {
+                n = min(sbi->inode_start - i, NUMBFS_IO_CHUNK_BLOCKS);
+                err = numbfs_read_blocks(sbi, chunk, i, n);
+                if (err)
+                        goto exit;
+                h = numbfs_fsck_fold(h, chunk, (size_t)n * sbi->block_size);
+        }
+        for (i = sbi->bbitmap_start; i < sbi->data_start; i += n) {
+                n = min(sbi->data_start - i, NUMBFS_IO_CHUNK_BLOCKS);
+                err = numbfs_read_blocks(sbi, chunk, i, n);
+                if (err)
+                        goto exit;
+                h = numbfs_fsck_fold(h, chunk, (size_t)n * sbi->block_size);
+        }
+        *digest = h;
+exit:
+        numbfs_bfree(sbi, chunk);
+        return err;
+}
+
+static char *numbfs_fsck_state_path(const char *dev)
+{
+        char *path = malloc(strlen(dev) + sizeof(".fsck"));
+
+        if (path)
+                sprintf(path, "%s.fsck", dev);
+        return path;
+}
+
+/* true if DEV.fsck exists and matches @digest, filling @st */
+static bool numbfs_fsck_state_load(const char *dev,
+                                   unsigned long long digest,
+                                   struct numbfs_fsck_state *st)
+{
+        char *path = numbfs_fsck_state_path(dev);
+        bool hit = false;
+        int fd;
+
+        if (!path)
+                return false;
+        fd = open(path, O_RDONLY);
+        free(path);
+        if (fd < 0)
+                return false;
+
+        if (read(fd, st, sizeof(*st)) == (ssize_t)sizeof(*st) &&
+            le32_to_cpu(st->st_magic) == NUMBFS_STATE_MAGIC &&
+            le64_to_cpu(st->st_digest) == digest)
+                hit = true;
+        close(fd);
+        return hit;
+}
+
+static void numbfs_fsck_state_save(const char *dev,
+                                   unsigned long long digest,
+                                   const struct numbfs_fsck_state *st)
+{
+        struct numbfs_fsck_state out = *st;
+        char *path = numbfs_fsck_state_path(dev);
+        int fd;
+
+        if (!path)
+                return;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "warning: cannot write %s\n", path);
+                free(path);
+                return;
+        }
+        free(path);
+
+        out.st_magic = cpu_to_le32(NUMBFS_STATE_MAGIC);
+        out.st_digest = cpu_to_le64(digest);
+        if (write(fd, &out, sizeof(out)) != (ssize_t)sizeof(out))
+                fprintf(stderr, "warning: short write to the state file\n");
+        close(fd);
+}
+
 static int numbfs_fsck(int argc, char **argv)
 {
         struct numbfs_fsck_cfg cfg = {
                 .show_inodes = 0,
                 .show_blocks = 0,
                 .nid = -1,
+                .uring_depth = 0,
+                .threads = 0,
                 .dev = NULL
         };
-        struct numbfs_superblock_info sbi;
-        char buf[BYTES_PER_BLOCK];
-        int fd, err, cnt, i;
+        struct numbfs_superblock_info sbi = {0};
+        struct numbfs_fsck_state st = { 0 };
+        unsigned long long digest = 0;
+        bool reported = false, fast = false;
+        int fd, err, cnt;
 
         numbfs_fsck_parse_args(argc, argv, &cfg);
 
-        fd = open(cfg.dev, O_RDWR, 0644);
+        if (cfg.direct) {
+                fd = open(cfg.dev, O_RDWR | O_DIRECT, 0644);
+                if (fd < 0) {
+                        fprintf(stderr, "warning: O_DIRECT unavailable (%d), using buffered I/O\n",
+                                -errno);
+                        cfg.direct = false;
+                }
+        }
+        if (!cfg.direct)
+                fd = open(cfg.dev, O_RDWR, 0644);
         if (fd < 0)
                 return -errno;
 
+        sbi.direct = cfg.direct;
         err = numbfs_get_superblock(&sbi, fd);
         if (err) {
                 fprintf(stderr, "failed to read superblock\n");
                 goto exit;
         }
 
-        printf("Superblock Information\n");
-        printf("    inode bitmap start:         %d\n", sbi.ibitmap_start);
-        printf("    inode zone start:           %d\n", sbi.inode_start);
-        printf("    block bitmap start:         %d\n", sbi.bbitmap_start);
-        printf("    data zone start:            %d\n", sbi.data_start);
-        printf("    free inodes:                %d\n", sbi.free_inodes);
-        printf("    total inodes:               %d\n", sbi.total_inodes);
-        printf("    total free blocks:          %d\n", sbi.free_blocks);
-        printf("    total data blocks:          %d\n", sbi.data_blocks);
+        /* redo a committed but unfinished transaction before reading */
+        err = numbfs_journal_replay(&sbi);
+        if (err) {
+                fprintf(stderr, "error: failed to replay the journal\n");
+                goto exit;
+        }
+
+        sbi.nthreads = cfg.threads;
+
+        /* a mapping would reintroduce the page cache in direct mode */
+        err = sbi.direct ? 0 : numbfs_map_device(&sbi, 0);
+        if (err) {
+                fprintf(stderr, "warning: failed to map image (%d), using file I/O\n",
+                        err);
+                err = 0;
+        }
+
+        if (cfg.uring_depth) {
+                err = numbfs_iou_init(&sbi, cfg.uring_depth);
+                if (err) {
+                        fprintf(stderr, "warning: io_uring unavailable (%d), using sync I/O\n",
+                                err);
+                        err = 0;
+                }
+        }
+
+        /* a matching digest lets the scan sections reuse cached results */
+        if (cfg.fast) {
+                err = numbfs_fsck_digest(&sbi, &digest);
+                if (err)
+                        goto exit;
+                fast = numbfs_fsck_state_load(cfg.dev, digest, &st);
+                if (!fast)
+                        memset(&st, 0, sizeof(st));
+        }
+
+        emitter.format = cfg.format;
+        reported = true;
+        switch (emitter.format) {
+        case NUMBFS_FMT_TEXT:
+                numbfs_emit("Superblock Information\n");
+                numbfs_emit("    inode bitmap start:         %d\n", sbi.ibitmap_start);
+                numbfs_emit("    inode zone start:           %d\n", sbi.inode_start);
+                numbfs_emit("    block bitmap start:         %d\n", sbi.bbitmap_start);
+                numbfs_emit("    data zone start:            %d\n", sbi.data_start);
+                numbfs_emit("    free inodes:                %d\n", sbi.free_inodes);
+                numbfs_emit("    total inodes:               %d\n", sbi.total_inodes);
+                numbfs_emit("    total free blocks:          %d\n", sbi.free_blocks);
+                numbfs_emit("    total data blocks:          %d\n", sbi.data_blocks);
+                numbfs_emit("    block size:                 %d\n", sbi.block_size);
+                break;
+        case NUMBFS_FMT_JSON:
+                numbfs_emit("{\"superblock\":{\"ibitmap_start\":%d,"
+                            "\"inode_start\":%d,\"bbitmap_start\":%d,"
+                            "\"data_start\":%d,\"free_inodes\":%d,"
+                            "\"total_inodes\":%d,\"free_blocks\":%d,"
+                            "\"data_blocks\":%d,\"block_size\":%d}",
+                            sbi.ibitmap_start, sbi.inode_start,
+                            sbi.bbitmap_start, sbi.data_start,
+                            sbi.free_inodes, sbi.total_inodes,
+                            sbi.free_blocks, sbi.data_blocks,
+                            sbi.block_size);
+                break;
+        case NUMBFS_FMT_BINARY: {
+                __le32 v[9];
+
+                numbfs_emit_raw(NUMBFS_REC_MAGIC, 4);
+                v[0] = cpu_to_le32(sbi.ibitmap_start);
+                v[1] = cpu_to_le32(sbi.inode_start);
+                v[2] = cpu_to_le32(sbi.bbitmap_start);
+                v[3] = cpu_to_le32(sbi.data_start);
+                v[4] = cpu_to_le32(sbi.free_inodes);
+                v[5] = cpu_to_le32(sbi.total_inodes);
+                v[6] = cpu_to_le32(sbi.free_blocks);
+                v[7] = cpu_to_le32(sbi.data_blocks);
+                v[8] = cpu_to_le32(sbi.block_size);
+                numbfs_emit_rec(NUMBFS_REC_SUPER, v, sizeof(v));
+                break;
+        }
+        }
 
         if (cfg.show_inodes) {
-                cnt = 0;
-                for (i = sbi.ibitmap_start; i < sbi.inode_start; i++) {
-                        err = pread(fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                        if (err != BYTES_PER_BLOCK) {
-                                fprintf(stderr, "failed to read block@%d\n", i);
-                                err = -EIO;
+                if (fast && (le32_to_cpu(st.st_flags) & NUMBFS_STATE_INODES)) {
+                        cnt = le32_to_cpu(st.st_inodes_used);
+                } else {
+                        err = numbfs_popcount_range(&sbi, sbi.ibitmap_start,
+                                        sbi.inode_start - sbi.ibitmap_start,
+                                        &cnt);
+                        if (err)
                                 goto exit;
-                        }
+                        /* the scan is the truth, counters may lag it */
+                        sbi.free_inodes = sbi.total_inodes - cnt;
+                        st.st_inodes_used = cpu_to_le32(cnt);
+                        st.st_flags |= cpu_to_le32(NUMBFS_STATE_INODES);
+                }
+                switch (emitter.format) {
+                case NUMBFS_FMT_TEXT:
+                        numbfs_emit("    inodes usage:               %.2f%%\n",
+                                    100.0 * cnt / sbi.total_inodes);
+                        break;
+                case NUMBFS_FMT_JSON:
+                        numbfs_emit(",\"inodes_used\":%d", cnt);
+                        break;
+                case NUMBFS_FMT_BINARY: {
+                        /* u8 zone (0 = inodes) + le32 used count */
+                        __u8 rec[5] = { 0 };
 
-                        cnt += numbfs_fsck_used(buf);
+                        rec[1] = cnt & 0xff;
+                        rec[2] = (cnt >> 8) & 0xff;
+                        rec[3] = (cnt >> 16) & 0xff;
+                        rec[4] = (cnt >> 24) & 0xff;
+                        numbfs_emit_rec(NUMBFS_REC_USAGE, rec, sizeof(rec));
+                        break;
+                }
                 }
-                BUG_ON(cnt != sbi.total_inodes - sbi.free_inodes);
-                printf("    inodes usage:               %.2f%%\n", 100.0 * cnt / sbi.total_inodes);
         }
 
         if (cfg.show_blocks) {
-                cnt = 0;
-                for (i = sbi.bbitmap_start; i < sbi.data_start; i++) {
-                        err = pread(fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                        if (err != BYTES_PER_BLOCK) {
-                                fprintf(stderr, "failed to read block@%d\n", i);
-                                err = -EIO;
+                if (fast && (le32_to_cpu(st.st_flags) & NUMBFS_STATE_BLOCKS)) {
+                        cnt = le32_to_cpu(st.st_blocks_used);
+                } else {
+                        err = numbfs_popcount_range(&sbi, sbi.bbitmap_start,
+                                        sbi.data_start - sbi.bbitmap_start,
+                                        &cnt);
+                        if (err)
                                 goto exit;
-                        }
+                        /* the scan is the truth, counters may lag it */
+                        sbi.free_blocks = sbi.data_blocks - cnt;
+                        st.st_blocks_used = cpu_to_le32(cnt);
+                        st.st_flags |= cpu_to_le32(NUMBFS_STATE_BLOCKS);
+                }
+                switch (emitter.format) {
+                case NUMBFS_FMT_TEXT:
+                        numbfs_emit("    blocks usage:               %.2f%%\n",
+                                    100.0 * cnt / sbi.data_blocks);
+                        break;
+                case NUMBFS_FMT_JSON:
+                        numbfs_emit(",\"blocks_used\":%d", cnt);
+                        break;
+                case NUMBFS_FMT_BINARY: {
+                        /* u8 zone (1 = blocks) + le32 used count */
+                        __u8 rec[5] = { 1 };
 
-                        cnt += numbfs_fsck_used(buf);
+                        rec[1] = cnt & 0xff;
+                        rec[2] = (cnt >> 8) & 0xff;
+                        rec[3] = (cnt >> 16) & 0xff;
+                        rec[4] = (cnt >> 24) & 0xff;
+                        numbfs_emit_rec(NUMBFS_REC_USAGE, rec, sizeof(rec));
+                        break;
                 }
-                BUG_ON(cnt != sbi.data_blocks - sbi.free_blocks);
-                printf("    blocks usage:               %.2f%%\n", 100.0 * cnt / sbi.data_blocks);
+                }
+        }
+
+        if (cfg.check) {
+                /* never cached: the digest covers neither the inode
+                 * table nor the dirent blocks the check validates */
+                err = numbfs_fsck_check(&sbi);
+                if (err)
+                        goto exit;
+        }
+
+        if (cfg.scrub) {
+                err = numbfs_fsck_scrub(&sbi);
+                if (err)
+                        goto exit;
         }
 
         if (cfg.nid >= 0) {
@@ -243,10 +1338,35 @@ static int numbfs_fsck(int argc, char **argv)
                 }
         }
 
+        if (cfg.xattrs) {
+                err = numbfs_fsck_show_xattrs(&sbi, cfg.nid);
+                if (err) {
+                        fprintf(stderr, "error: failed to show xattrs\n");
+                        goto exit;
+                }
+        }
+
+        /* remember this run for the next --fast sweep */
+        if (cfg.fast && !fast)
+                numbfs_fsck_state_save(cfg.dev, digest, &st);
+
         err = 0;
 exit:
+        if (reported && emitter.format == NUMBFS_FMT_JSON)
+                numbfs_emit("}\n");
+        numbfs_emit_flush();
+        numbfs_iou_exit(&sbi);
+        if (numbfs_bitmap_release(&sbi))
+                fprintf(stderr, "error: failed to flush bitmaps\n");
+        if (numbfs_cache_destroy(&sbi))
+                fprintf(stderr, "error: failed to flush block cache\n");
+        if (numbfs_unmap_device(&sbi))
+                fprintf(stderr, "error: failed to sync image mapping\n");
+        numbfs_pool_release(&sbi);
         close(fd);
         free(cfg.dev);
+        if (cfg.stats)
+                numbfs_stats_dump();
         return err;
 }
 
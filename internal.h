@@ -8,9 +8,56 @@
 
 #include "disk.h"
 #include <stdbool.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* number of blocks held by the in-memory block cache */
+#define NUMBFS_CACHE_BLOCKS     64
+
+struct numbfs_cached_block {
+        /* block number on the device, -1 if this slot is unused */
+        int blkno;
+        bool dirty;
+        /* tick of the last access, used for LRU eviction */
+        unsigned long tick;
+        /* sbi->block_size bytes, allocated with the cache */
+        char *data;
+};
+
+/*
+ * An LRU cache of on-disk blocks keyed by block number, with dirty
+ * tracking; sits behind numbfs_read_block()/numbfs_write_block() so
+ * repeated metadata accesses do not hit the device.
+ */
+struct numbfs_block_cache {
+        struct numbfs_cached_block blocks[NUMBFS_CACHE_BLOCKS];
+        unsigned long tick;
+};
+
+/*
+ * In-memory copy of an on-disk bitmap zone. Allocations are served
+ * from memory with a rotating next-free cursor; the zone is written
+ * back in one sequential pass by numbfs_bitmap_flush().
+ */
+struct numbfs_bitmap {
+        /* first block of the on-disk bitmap zone */
+        int startblk;
+        /* number of valid bits */
+        int nbits;
+        /* next-free search hint */
+        int cursor;
+        bool dirty;
+        char *data;
+};
+
+struct numbfs_buf_pool;
+struct numbfs_journal;
 
 struct numbfs_superblock_info {
         int fd;
+        /* block size in bytes: 512 (default), 4096 or 65536 */
+        int block_size;
         int feature;
         int total_inodes;
         int free_inodes;
@@ -20,11 +67,37 @@ struct numbfs_superblock_info {
         int inode_start;
         int bbitmap_start;
         int data_start;
+        /* journal zone, only valid with NUMBFS_FEATURE_JOURNAL */
+        int journal_start;
+        int journal_blocks;
+        /* stored zone checksums, only valid with NUMBFS_FEATURE_CSUM */
+        unsigned int ibitmap_csum;
+        unsigned int itable_csum;
+        unsigned int bbitmap_csum;
 
         long long size;
+
+        struct numbfs_block_cache *cache;
+        struct numbfs_bitmap ibmap;
+        struct numbfs_bitmap bbmap;
+        /* io_uring engine for batched block I/O, NULL for sync I/O */
+        struct numbfs_iou *iou;
+
+        /* whole-image mapping for regular-file targets, NULL otherwise */
+        char *map;
+        long long map_size;
+
+        /* number of worker threads for scan passes, <= 1 means serial */
+        int nthreads;
+
+        /* O_DIRECT target: all device I/O goes through aligned buffers */
+        bool direct;
+        struct numbfs_buf_pool *pool;
+
+        /* in-memory staging area of the intent log, NULL if disabled */
+        struct numbfs_journal *jnl;
 };
 
-/* TODO: xattr support */
 struct numbfs_inode_info {
         /* in */
         struct numbfs_superblock_info *sbi;
@@ -37,33 +110,105 @@ struct numbfs_inode_info {
         int gid;
         int size;
         int data[NUMBFS_NUM_DATA_ENTRY];
+        /* first data-zone block and entry count of the xattr region */
+        int xattr_start;
+        int xattr_count;
+
+        /* the in-memory inode differs from its on-disk slot */
+        bool dirty;
+        /* the file bytes live in inline_d[], data[] is all holes */
+        bool inline_data;
+        char inline_d[NUMBFS_INLINE_MAX];
+        /* the inode maps data with (start, len) extent pairs in data[] */
+        bool extent;
+        /* extent mapping cache: entry and logical start of the last hit */
+        bool ext_valid;
+        int ext_idx;
+        int ext_lstart;
 };
 
-#define NUMBFS_BLOCKS_PER_BLOCK (BYTES_PER_BLOCK * BITS_PER_BYTE)
-#define NUMBFS_NODES_PER_BLOCK  (BYTES_PER_BLOCK / sizeof(struct numbfs_inode))
+/* number of (start, len) extent pairs that fit in i_data[] */
+#define NUMBFS_EXTENT_ENTRIES   (NUMBFS_NUM_DATA_ENTRY / 2)
+
+/* supported block sizes */
+static inline bool numbfs_valid_bsize(int bsize)
+{
+        return bsize == BYTES_PER_BLOCK || bsize == 4096 ||
+               bsize == NUMBFS_MAX_BLOCK_SIZE;
+}
+
+/* number of blocks tracked by one bitmap block */
+static inline int numbfs_blocks_per_blk(const struct numbfs_superblock_info *sbi)
+{
+        return sbi->block_size * BITS_PER_BYTE;
+}
+
+/* number of inode slots in one inode zone block */
+static inline int numbfs_nodes_per_blk(const struct numbfs_superblock_info *sbi)
+{
+        return sbi->block_size / sizeof(struct numbfs_inode);
+}
 
 /* calculate the block number of the bitmap related to @blkno */
-static inline int numbfs_bmap_blk(int startblk, int blkno)
+static inline int numbfs_bmap_blk(const struct numbfs_superblock_info *sbi,
+                                  int startblk, int blkno)
 {
-        return startblk + blkno / NUMBFS_BLOCKS_PER_BLOCK;
+        return startblk + blkno / numbfs_blocks_per_blk(sbi);
 }
 
 /* calculate the byte number in the block related to @blkno */
-static inline int numbfs_bmap_byte(int blkno)
+static inline int numbfs_bmap_byte(const struct numbfs_superblock_info *sbi,
+                                   int blkno)
 {
-        return  (blkno % NUMBFS_BLOCKS_PER_BLOCK) / BITS_PER_BYTE;
+        return  (blkno % numbfs_blocks_per_blk(sbi)) / BITS_PER_BYTE;
 }
 
 /* calculate the bit number in the byte related to @blkno */
 static inline int numbfs_bmap_bit(int blkno)
 {
-        return (blkno % NUMBFS_BLOCKS_PER_BLOCK) % BITS_PER_BYTE;
+        return blkno % BITS_PER_BYTE;
+}
+
+/*
+ * Count the set bits in @len bytes at @buf; @len must be a multiple
+ * of 8. Uses an AVX2 nibble-LUT kernel when available, otherwise
+ * 64-bit word popcounts.
+ */
+static inline int numbfs_popcount(const void *buf, int len)
+{
+        const unsigned long long *w = buf;
+        int cnt = 0, i = 0;
+
+#ifdef __AVX2__
+        const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                             1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3,
+                                             1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+        __m256i acc = _mm256_setzero_si256();
+
+        for (; i + 4 <= len / 8; i += 4) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(w + i));
+                __m256i lo = _mm256_and_si256(v, mask);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask);
+                __m256i pc = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                             _mm256_shuffle_epi8(lut, hi));
+
+                acc = _mm256_add_epi64(acc,
+                        _mm256_sad_epu8(pc, _mm256_setzero_si256()));
+        }
+        cnt += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+               _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+#endif
+        for (; i < len / 8; i++)
+                cnt += __builtin_popcountll(w[i]);
+        return cnt;
 }
 
 static inline int numbfs_inode_blk(struct numbfs_superblock_info *sbi,
                                    int nid)
 {
-        return sbi->inode_start + nid / NUMBFS_NODES_PER_BLOCK;
+        return sbi->inode_start + nid / numbfs_nodes_per_blk(sbi);
 }
 
 static inline int numbfs_data_blk(struct numbfs_superblock_info *sbi,
@@ -72,35 +217,265 @@ static inline int numbfs_data_blk(struct numbfs_superblock_info *sbi,
         return sbi->data_start + blk;
 }
 
-/* read/write the blkno-th block in the device */
+/*
+ * Hot-path instrumentation. The counters are plain increments kept
+ * unconditionally (the lib helpers only run on the main thread);
+ * tools opt in to the report with --stats or NUMBFS_STATS=1 and dump
+ * it at exit via numbfs_stats_dump().
+ */
+struct numbfs_stats {
+        long long blocks_read;
+        long long blocks_written;
+        long long bytes_read;
+        long long bytes_written;
+        /* pread/pwrite/io_uring_enter calls issued */
+        long long syscalls;
+        long long cache_hits;
+        long long cache_misses;
+        long long block_allocs;
+        long long inode_allocs;
+        long long inode_dumps;
+        long long journal_commits;
+};
+
+extern struct numbfs_stats numbfs_stats;
+
+/* print the counters above to stderr */
+void numbfs_stats_dump(void);
+
+/* read/write the blkno-th block (sbi->block_size bytes) in the device */
 int numbfs_read_block(struct numbfs_superblock_info *sbi,
-                      char buf[BYTES_PER_BLOCK], int blkno);
+                      char *buf, int blkno);
 int numbfs_write_block(struct numbfs_superblock_info *sbi,
-                       char buf[BYTES_PER_BLOCK], int blkno);
+                       char *buf, int blkno);
+
+/* chunk size (in blocks) used for batched multi-block I/O */
+#define NUMBFS_IO_CHUNK_BLOCKS  1024
+
+/* O_DIRECT buffer/offset alignment, 4K satisfies any sane device */
+#define NUMBFS_DIRECT_ALIGN     4096
+
+/*
+ * Get/put a transient I/O buffer of @size bytes. In O_DIRECT mode the
+ * buffers come from a small pool of pre-allocated 4K-aligned chunks
+ * (stack temporaries cannot satisfy the alignment); otherwise this is
+ * plain malloc()/free().
+ */
+void *numbfs_balloc(struct numbfs_superblock_info *sbi, unsigned long size);
+void numbfs_bfree(struct numbfs_superblock_info *sbi, void *ptr);
+void numbfs_pool_release(struct numbfs_superblock_info *sbi);
+
+/* read/write @count consecutive blocks in a single syscall */
+int numbfs_read_blocks(struct numbfs_superblock_info *sbi, char *buf,
+                       int blkno, int count);
+int numbfs_write_blocks(struct numbfs_superblock_info *sbi, char *buf,
+                        int blkno, int count);
+
+/* default io_uring submission queue depth */
+#define NUMBFS_IOU_DEPTH        32
+
+/* default journal zone size in blocks: one header plus 32 copies */
+#define NUMBFS_JOURNAL_BLOCKS   33
+
+/*
+ * Physical-block intent log. With NUMBFS_FEATURE_JOURNAL enabled,
+ * in-place metadata block writes are staged in memory and committed
+ * in batches: the block copies plus a describing header land in the
+ * journal zone and are fdatasync'ed before the in-place writes, so a
+ * crash leaves either the old or the new metadata, never a mix.
+ * numbfs_journal_replay() redoes a committed but unfinished
+ * transaction; numbfs_journal_release() commits what is staged and
+ * frees the log.
+ */
+/*
+ * CRC32C (Castagnoli). The SSE4.2 path folds eight bytes per crc32
+ * instruction and keeps up with device bandwidth; builds without the
+ * ISA extension fall back to a table-driven loop. Chain calls by
+ * passing the previous result as @crc.
+ */
+__u32 numbfs_crc32c(__u32 crc, const void *buf, unsigned long len);
+
+/* crc32c of the whole zone [startblk, startblk + nblocks) */
+int numbfs_csum_zone(struct numbfs_superblock_info *sbi, int startblk,
+                     int nblocks, __u32 *crc);
+
+int numbfs_journal_init(struct numbfs_superblock_info *sbi);
+int numbfs_journal_commit(struct numbfs_superblock_info *sbi);
+int numbfs_journal_release(struct numbfs_superblock_info *sbi);
+int numbfs_journal_replay(struct numbfs_superblock_info *sbi);
+
+/* set up/tear down the io_uring engine; without it I/O is synchronous */
+int numbfs_iou_init(struct numbfs_superblock_info *sbi, int depth);
+void numbfs_iou_exit(struct numbfs_superblock_info *sbi);
+/*
+ * Queue a multi-block transfer; @buf must stay valid until the next
+ * numbfs_iou_flush(). Falls back to synchronous I/O if the engine is
+ * not set up.
+ */
+int numbfs_iou_queue(struct numbfs_superblock_info *sbi, bool write,
+                     char *buf, int blkno, int count);
+/* submit all queued transfers and wait for their completion */
+int numbfs_iou_flush(struct numbfs_superblock_info *sbi);
+
+/* popcount the bitmap zone [startblk, startblk + nblocks) */
+int numbfs_popcount_range(struct numbfs_superblock_info *sbi,
+                          int startblk, int nblocks, int *cnt);
+
+/* zero [startblk, startblk + nblocks) with sbi->nthreads workers */
+int numbfs_zero_range(struct numbfs_superblock_info *sbi,
+                      int startblk, int nblocks);
+
+/*
+ * Map a regular-file image so block I/O becomes memcpy into the page
+ * cache; a no-op for block devices. @size 0 means the whole file.
+ */
+int numbfs_map_device(struct numbfs_superblock_info *sbi, long long size);
+/* msync and tear down the image mapping */
+int numbfs_unmap_device(struct numbfs_superblock_info *sbi);
+
+/* write all dirty cached blocks back to the device */
+int numbfs_cache_flush(struct numbfs_superblock_info *sbi);
+/* flush and release the block cache */
+int numbfs_cache_destroy(struct numbfs_superblock_info *sbi);
 
 /* read the on=disk superblock */
 int numbfs_get_superblock(struct numbfs_superblock_info *sbi, int fd);
 
 /* data block management */
 int numbfs_alloc_block(struct numbfs_superblock_info *sbi, int *blkno);
+int numbfs_alloc_blocks(struct numbfs_superblock_info *sbi, int *blks,
+                        int count);
+/* alloc @count contiguous data blocks starting at *@start */
+int numbfs_alloc_contig(struct numbfs_superblock_info *sbi, int *start,
+                        int count);
+/* alloc the specific data block @blkno, -EBUSY if it is in use */
+int numbfs_alloc_block_at(struct numbfs_superblock_info *sbi, int blkno);
 int numbfs_free_block(struct numbfs_superblock_info *sbi, int blkno);
 
+/* write the in-memory bitmaps back to the device */
+int numbfs_bitmap_flush(struct numbfs_superblock_info *sbi);
+/*
+ * Write the in-memory free counters (and a refreshed superblock
+ * checksum) back to block 1. Called in batch at bitmap flush time so
+ * allocators never serialize on the superblock.
+ */
+int numbfs_sync_superblock(struct numbfs_superblock_info *sbi);
+/* flush and release the in-memory bitmaps */
+int numbfs_bitmap_release(struct numbfs_superblock_info *sbi);
+
 /* get inode information according inode number*/
 int numbfs_get_inode(struct numbfs_superblock_info *sbi,
                      struct numbfs_inode_info *inode_i);
+/* write the in-memory inode back to the inode zone */
+int numbfs_dump_inode(struct numbfs_inode_info *inode_i);
+/*
+ * Write the inode back only if it is dirty. Writes mark the in-memory
+ * inode dirty instead of dumping it, so call this once when done with
+ * an inode; dirty inodes sharing an inode block coalesce in the block
+ * cache into a single device write.
+ */
+int numbfs_iput(struct numbfs_inode_info *inode_i);
 /* logical block number to physical block address translation */
 int numbfs_inode_blkaddr(struct numbfs_inode_info *inode_i,
                          int pos, bool alloc, bool extent);
 
-/* read/write the logical block in inode's address space */
+/* read/write within one logical block in inode's address space */
 int numbfs_pwrite_inode(struct numbfs_inode_info *inode_i,
-                        char buf[BYTES_PER_BLOCK], int offset, int len);
+                        char *buf, int offset, int len);
 int numbfs_pread_inode(struct numbfs_inode_info *inode_i,
-                       char buf[BYTES_PER_BLOCK], int offset, int len);
+                       char *buf, int offset, int len);
+
+/*
+ * Arbitrary-length streaming variants: fully covered blocks skip the
+ * read-modify-write cycle and physically contiguous spans collapse
+ * into single multi-block transfers.
+ */
+int numbfs_pwrite_inode_stream(struct numbfs_inode_info *inode_i,
+                               char *buf, int offset, int len);
+int numbfs_pread_inode_stream(struct numbfs_inode_info *inode_i,
+                              char *buf, int offset, int len);
+
+/*
+ * Reserve and map the blocks backing [0, size) in one contiguous
+ * bitmap pass when the final file size is known up front. The blocks
+ * are not zeroed; the caller must overwrite the whole range.
+ */
+int numbfs_fallocate(struct numbfs_inode_info *inode_i, int size);
+
+/* on-disk size of one dirent carrying a @name_len-byte name */
+int numbfs_dirent_size(struct numbfs_superblock_info *sbi, int name_len);
+
+/*
+ * Format-independent directory walk: yields one dirent at a time in
+ * the fixed 64-byte form whatever the on-disk layout (classic records
+ * or the packed NUMBFS_FEATURE_CDIR form). Shared by the directory
+ * handle below and the fsck passes.
+ */
+struct numbfs_dir_iter {
+        struct numbfs_inode_info *inode;
+        /* byte offset of the next record */
+        int pos;
+        /* block currently buffered in @buf, -1 if none */
+        int blk;
+        char buf[NUMBFS_MAX_BLOCK_SIZE];
+        /* the entry produced by the last successful _next() */
+        struct numbfs_dirent de;
+};
+
+void numbfs_dir_iter_init(struct numbfs_dir_iter *it,
+                          struct numbfs_inode_info *inode_i);
+/* returns 1 when an entry was produced, 0 at the end, < 0 on error */
+int numbfs_dir_iter_next(struct numbfs_dir_iter *it);
+
+/*
+ * A directory handle with an in-memory hash index over its dirents:
+ * numbfs_dir_open() loads the directory once, after which lookups and
+ * duplicate detection cost O(1) instead of a linear block scan per
+ * name. Inserts append to the directory through the handle's inode,
+ * which is written back by numbfs_dir_close().
+ */
+struct numbfs_dir {
+        struct numbfs_inode_info inode;
+        /* number of dirents, including "." and ".." */
+        int nr;
+        int capacity;
+        struct numbfs_dirent *de;
+        /* name hash -> index into de[], -1 when empty, linear probing */
+        int nbuckets;
+        int *buckets;
+};
+
+int numbfs_dir_open(struct numbfs_superblock_info *sbi,
+                    struct numbfs_dir *dir, int nid);
+/* returns the inode number bound to @name, or -ENOENT */
+int numbfs_dir_lookup(struct numbfs_dir *dir, const char *name);
+/* append a dirent for (@name, @nid), -EEXIST if @name is taken */
+int numbfs_dir_insert(struct numbfs_dir *dir, const char *name,
+                      int nid, int type);
+/* write back the directory inode and release the index */
+int numbfs_dir_close(struct numbfs_dir *dir);
 
 int numbfs_alloc_inode(struct numbfs_superblock_info *sbi, int *nid);
 int numbfs_free_inode(struct numbfs_superblock_info *sbi, int nid);
 
+/*
+ * Extended attributes: the whole packed region is rewritten on every
+ * set, so reads stay a single contiguous transfer. The inode is only
+ * marked dirty, numbfs_iput() writes it back.
+ */
+/* returns the value length, -ENOENT if @name is absent */
+int numbfs_xattr_get(struct numbfs_inode_info *inode_i, const char *name,
+                     char *value, int size);
+/* add or replace @name; a NULL @value removes it */
+int numbfs_xattr_set(struct numbfs_inode_info *inode_i, const char *name,
+                     const char *value, int value_len);
+/* fill @names with NUL-terminated names, returns the bytes used */
+int numbfs_xattr_list(struct numbfs_inode_info *inode_i,
+                      char *names, int size);
+/* number of blocks of the region at @xstart holding @count entries */
+int numbfs_xattr_blocks(struct numbfs_superblock_info *sbi,
+                        int xstart, int count);
+
 /* make an empty dir */
 int numbfs_empty_dir(struct numbfs_superblock_info *sbi, int pnid);
 
@@ -3,6 +3,7 @@
  * Copyright (C) 2025, Hongzhen Luo
  */
 
+#define _GNU_SOURCE
 #include "internal.h"
 #include "numbfs_config.h"
 #include "disk.h"
@@ -15,7 +16,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <limits.h>
 
 #define NUMBFS_DEFAULT_INODES 4096
 
@@ -25,9 +31,25 @@ static struct option log_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"num_inodes", required_argument, NULL, 2},
         {"size", required_argument, NULL, 's'},
+        {"extent", no_argument, NULL, 'e'},
+        {"uring", optional_argument, NULL, 'u'},
+        {"root-dir", required_argument, NULL, 'r'},
+        {"block-size", required_argument, NULL, 'b'},
+        {"threads", required_argument, NULL, 't'},
+        {"direct", no_argument, NULL, 4},
+        {"journal", optional_argument, NULL, 5},
+        {"checksum", no_argument, NULL, 6},
+        {"compact-dirents", no_argument, NULL, 7},
+        {"inline-data", no_argument, NULL, 8},
+        {"stats", no_argument, NULL, 3},
         {0, 0, 0, 0}
 };
 
+static int uring_depth;
+static int journal_blocks;
+static char *root_dir;
+static bool stats;
+
 static void numbfs_help_info(void)
 {
         printf(
@@ -38,6 +60,17 @@ static void numbfs_help_info(void)
                 " --help                display this help information and exit\n"
                 " --num_inodes=#        specify the number of inodes (default: 4096)\n"
                 " --size=#{M,K,G}       spacify the filesystem image size\n"
+                " --extent|-e           use extent-based data block mapping\n"
+                " --uring[=#]           use io_uring with the given queue depth (default: 32)\n"
+                " --root-dir=DIR|-r DIR populate the image from DIR at format time\n"
+                " --block-size=#        block size in bytes: 512, 4096 or 65536 (default: 512)\n"
+                " --threads=N|-t N      zero the metadata zones with N worker threads\n"
+                " --direct              open the device with O_DIRECT, bypassing the page cache\n"
+                " --journal[=#]         journal metadata updates in a #-block zone (default: 33)\n"
+                " --checksum            protect the superblock and metadata zones with crc32c\n"
+                " --compact-dirents     pack directories with variable-length dirents\n"
+                " --inline-data         keep files of up to 40 bytes inside the inode\n"
+                " --stats               print I/O and allocation counters at exit\n"
         );
 }
 
@@ -56,7 +89,16 @@ static int numbfs_open_dev(char *dev)
         int fd, ret;
         struct stat st;
 
-        fd = open(dev, O_RDWR | O_CREAT, 0644);
+        if (sbi.direct) {
+                fd = open(dev, O_RDWR | O_CREAT | O_DIRECT, 0644);
+                if (fd < 0) {
+                        fprintf(stderr, "warning: O_DIRECT unavailable (%d), using buffered I/O\n",
+                                -errno);
+                        sbi.direct = false;
+                }
+        }
+        if (!sbi.direct)
+                fd = open(dev, O_RDWR | O_CREAT, 0644);
         if (fd < 0)
                 return -errno;
 
@@ -77,11 +119,66 @@ static int numbfs_parse_args(int argc, char **argv)
         char *img_path, unit;
         long long size;
 
-        while ((opt = getopt_long(argc, argv, "s:h", log_options, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "s:heb:r:t:", log_options, NULL)) != -1) {
                 switch(opt) {
                         case 'h':
                                 numbfs_help_info();
                                 exit(0);
+                        case 'e':
+                                sbi.feature |= NUMBFS_FEATURE_EXTENT;
+                                break;
+                        case 't':
+                                sbi.nthreads = atoi(optarg);
+                                if (sbi.nthreads <= 0) {
+                                        fprintf(stderr, "Error: invalid thread count\n");
+                                        return -EINVAL;
+                                }
+                                break;
+                        case 'u':
+                                uring_depth = optarg ? atoi(optarg) :
+                                                NUMBFS_IOU_DEPTH;
+                                if (uring_depth <= 0) {
+                                        fprintf(stderr, "Error: invalid uring queue depth\n");
+                                        return -EINVAL;
+                                }
+                                break;
+                        case 'r':
+                                root_dir = strdup(optarg);
+                                if (!root_dir)
+                                        return -ENOMEM;
+                                break;
+                        case 'b':
+                                val = atoi(optarg);
+                                if (!numbfs_valid_bsize(val)) {
+                                        fprintf(stderr, "Error: invalid block size: %d, should be 512, 4096 or 65536\n", val);
+                                        return -EINVAL;
+                                }
+                                sbi.block_size = val;
+                                break;
+                        case 3:
+                                stats = true;
+                                break;
+                        case 4:
+                                sbi.direct = true;
+                                break;
+                        case 5:
+                                journal_blocks = optarg ? atoi(optarg) :
+                                                NUMBFS_JOURNAL_BLOCKS;
+                                if (journal_blocks < 2) {
+                                        fprintf(stderr, "Error: invalid journal size\n");
+                                        return -EINVAL;
+                                }
+                                sbi.feature |= NUMBFS_FEATURE_JOURNAL;
+                                break;
+                        case 6:
+                                sbi.feature |= NUMBFS_FEATURE_CSUM;
+                                break;
+                        case 7:
+                                sbi.feature |= NUMBFS_FEATURE_CDIR;
+                                break;
+                        case 8:
+                                sbi.feature |= NUMBFS_FEATURE_INLINE;
+                                break;
                         case 2:
                                 val = atoi(optarg);
                                 if (val <= 0 || val & 0x7) {
@@ -125,12 +222,30 @@ static int numbfs_parse_args(int argc, char **argv)
 
         ret = numbfs_open_dev(img_path);
         free(img_path);
+        if (ret)
+                return ret;
+
+        if (uring_depth) {
+                ret = numbfs_iou_init(&sbi, uring_depth);
+                if (ret) {
+                        fprintf(stderr, "warning: io_uring unavailable (%d), using sync I/O\n",
+                                ret);
+                        ret = 0;
+                }
+        }
         return ret;
 }
 
 static void numbfs_init_config(void)
 {
+        char *env = getenv("NUMBFS_STATS");
+
+        if (env && atoi(env))
+                stats = true;
+
         sbi.fd = -1;
+        sbi.feature = 0;
+        sbi.block_size = BYTES_PER_BLOCK;
         sbi.total_inodes = NUMBFS_DEFAULT_INODES;
         sbi.free_inodes = sbi.total_inodes - NUMBFS_ROOT_NID;
         sbi.size = -1;
@@ -139,35 +254,383 @@ static void numbfs_init_config(void)
 static int numbfs_mkdir_lostfound(void)
 {
 #define LOSTFOUND       "lost+found"
-#define LOSTFOUNDLEN    strlen(LOSTFOUND)
-        struct numbfs_inode_info ni;
-        struct numbfs_dirent *dir;
-        char buf[BYTES_PER_BLOCK];
+        struct numbfs_dir root;
         int nid;
         int err;
 
+        err = numbfs_dir_open(&sbi, &root, NUMBFS_ROOT_NID);
+        if (err)
+                return err;
+
+        if (numbfs_dir_lookup(&root, LOSTFOUND) >= 0) {
+                err = 0;
+                goto out;
+        }
+
         nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
-        if (nid <= NUMBFS_ROOT_NID)
-                return -EINVAL;
+        if (nid <= NUMBFS_ROOT_NID) {
+                err = -EINVAL;
+                goto out;
+        }
+
+        err = numbfs_dir_insert(&root, LOSTFOUND, nid, DT_DIR);
+out:
+        if (!err)
+                err = numbfs_dir_close(&root);
+        else
+                numbfs_dir_close(&root);
+#undef  LOSTFOUND
+        return err;
+}
+
+/*
+ * Bulk ingest for --root-dir: a producer thread walks the source tree
+ * and reads file contents while the main thread creates inodes and
+ * dirents, so directory traversal and source I/O overlap metadata
+ * writes. The numbfs_* helpers are not thread-safe, so only the main
+ * thread ever touches @sbi.
+ */
+#define NUMBFS_INGEST_DEPTH     64
+#define NUMBFS_INGEST_MAX_DIRS  64
+
+enum {
+        NUMBFS_INGEST_DIR_ENTER,
+        NUMBFS_INGEST_FILE,
+        NUMBFS_INGEST_DIR_LEAVE,
+};
+
+struct numbfs_ingest_item {
+        int type;
+        char name[NUMBFS_MAX_PATH_LEN];
+        int mode;
+        int uid;
+        int gid;
+        long long size;
+        /* file contents (or symlink target), NULL for directories */
+        char *data;
+};
+
+static struct {
+        struct numbfs_ingest_item items[NUMBFS_INGEST_DEPTH];
+        int head, tail, count;
+        bool done;
+        int err;
+        pthread_mutex_t lock;
+        pthread_cond_t not_empty;
+        pthread_cond_t not_full;
+} ingest;
+
+static void numbfs_ingest_push(struct numbfs_ingest_item *item)
+{
+        pthread_mutex_lock(&ingest.lock);
+        while (ingest.count == NUMBFS_INGEST_DEPTH)
+                pthread_cond_wait(&ingest.not_full, &ingest.lock);
+        ingest.items[ingest.tail] = *item;
+        ingest.tail = (ingest.tail + 1) % NUMBFS_INGEST_DEPTH;
+        ingest.count++;
+        pthread_cond_signal(&ingest.not_empty);
+        pthread_mutex_unlock(&ingest.lock);
+}
+
+/* returns false once the producer is done and the queue has drained */
+static bool numbfs_ingest_pop(struct numbfs_ingest_item *item)
+{
+        pthread_mutex_lock(&ingest.lock);
+        while (!ingest.count && !ingest.done)
+                pthread_cond_wait(&ingest.not_empty, &ingest.lock);
+        if (!ingest.count) {
+                pthread_mutex_unlock(&ingest.lock);
+                return false;
+        }
+        *item = ingest.items[ingest.head];
+        ingest.head = (ingest.head + 1) % NUMBFS_INGEST_DEPTH;
+        ingest.count--;
+        pthread_cond_signal(&ingest.not_full);
+        pthread_mutex_unlock(&ingest.lock);
+        return true;
+}
+
+static int numbfs_ingest_read_file(const char *path, long long size,
+                                   char **datap)
+{
+        char *data;
+        long long done = 0;
+        ssize_t n;
+        int fd;
+
+        data = malloc(size ? size : 1);
+        if (!data)
+                return -ENOMEM;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                free(data);
+                return -errno;
+        }
+
+        while (done < size) {
+                n = read(fd, data + done, size - done);
+                if (n <= 0) {
+                        close(fd);
+                        free(data);
+                        return n ? -errno : -EIO;
+                }
+                done += n;
+        }
+        close(fd);
+        *datap = data;
+        return 0;
+}
+
+static int numbfs_ingest_walk(const char *path)
+{
+        struct numbfs_ingest_item item;
+        struct dirent *d;
+        struct stat st;
+        char sub[PATH_MAX];
+        DIR *dir;
+        ssize_t n;
+        int err;
+
+        dir = opendir(path);
+        if (!dir) {
+                fprintf(stderr, "failed to open dir %s\n", path);
+                return -errno;
+        }
+
+        while ((d = readdir(dir)) != NULL) {
+                if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                        continue;
+
+                if (strlen(d->d_name) >= NUMBFS_MAX_PATH_LEN) {
+                        fprintf(stderr, "warning: skipping %s/%s: name too long\n",
+                                path, d->d_name);
+                        continue;
+                }
+                if (snprintf(sub, PATH_MAX, "%s/%s", path, d->d_name) >= PATH_MAX) {
+                        fprintf(stderr, "warning: skipping %s/%s: path too long\n",
+                                path, d->d_name);
+                        continue;
+                }
+
+                err = lstat(sub, &st);
+                if (err) {
+                        err = -errno;
+                        goto err_close;
+                }
 
+                memset(&item, 0, sizeof(item));
+                strcpy(item.name, d->d_name);
+                item.mode = st.st_mode;
+                item.uid = st.st_uid;
+                item.gid = st.st_gid;
+
+                if (S_ISDIR(st.st_mode)) {
+                        item.type = NUMBFS_INGEST_DIR_ENTER;
+                        numbfs_ingest_push(&item);
+                        err = numbfs_ingest_walk(sub);
+                        if (err)
+                                goto err_close;
+                        item.type = NUMBFS_INGEST_DIR_LEAVE;
+                        item.data = NULL;
+                        numbfs_ingest_push(&item);
+                } else if (S_ISREG(st.st_mode)) {
+                        item.type = NUMBFS_INGEST_FILE;
+                        item.size = st.st_size;
+                        err = numbfs_ingest_read_file(sub, st.st_size,
+                                                      &item.data);
+                        if (err) {
+                                fprintf(stderr, "failed to read %s\n", sub);
+                                goto err_close;
+                        }
+                        numbfs_ingest_push(&item);
+                } else if (S_ISLNK(st.st_mode)) {
+                        item.type = NUMBFS_INGEST_FILE;
+                        item.data = malloc(PATH_MAX);
+                        if (!item.data) {
+                                err = -ENOMEM;
+                                goto err_close;
+                        }
+                        n = readlink(sub, item.data, PATH_MAX);
+                        if (n < 0) {
+                                err = -errno;
+                                free(item.data);
+                                goto err_close;
+                        }
+                        item.size = n;
+                        numbfs_ingest_push(&item);
+                } else {
+                        fprintf(stderr, "warning: skipping %s: unsupported file type\n",
+                                sub);
+                }
+        }
+        closedir(dir);
+        return 0;
+
+err_close:
+        closedir(dir);
+        return err;
+}
+
+static void *numbfs_ingest_producer(void *arg)
+{
+        int err = numbfs_ingest_walk((const char *)arg);
+
+        pthread_mutex_lock(&ingest.lock);
+        ingest.err = err;
+        ingest.done = true;
+        pthread_cond_signal(&ingest.not_empty);
+        pthread_mutex_unlock(&ingest.lock);
+        return NULL;
+}
+
+/* create a regular file (or symlink) from an ingest item under @parent */
+static int numbfs_ingest_file(struct numbfs_ingest_item *item,
+                              struct numbfs_dir *parent)
+{
+        struct numbfs_inode_info ni;
+        int nid, err, i;
+
+        err = numbfs_alloc_inode(&sbi, &nid);
+        if (err)
+                return err;
+
+        ni.sbi = &sbi;
+        ni.nid = nid;
+        ni.mode = item->mode;
+        ni.nlink = 1;
+        ni.uid = item->uid;
+        ni.gid = item->gid;
+        ni.size = 0;
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                ni.data[i] = NUMBFS_HOLE;
+        ni.extent = !!(sbi.feature & NUMBFS_FEATURE_EXTENT);
+        ni.ext_valid = false;
+        ni.inline_data = false;
+        ni.xattr_start = 0;
+        ni.xattr_count = 0;
+        /* a fresh inode has no on-disk slot to match yet */
+        ni.dirty = true;
+
+        /* extent mapping has no fixed per-file limit, direct blocks do */
+        if (!(sbi.feature & NUMBFS_FEATURE_EXTENT) &&
+            item->size > NUMBFS_NUM_DATA_ENTRY * sbi.block_size) {
+                fprintf(stderr, "Error: %s exceeds %d bytes, format with --extent\n",
+                        item->name, NUMBFS_NUM_DATA_ENTRY * sbi.block_size);
+                return -E2BIG;
+        }
+
+        if (item->size) {
+                /* the whole range is overwritten right below */
+                err = numbfs_fallocate(&ni, item->size);
+                if (err)
+                        return err;
+                err = numbfs_pwrite_inode_stream(&ni, item->data, 0,
+                                                 item->size);
+                if (err)
+                        return err;
+        }
+        err = numbfs_iput(&ni);
+        if (err)
+                return err;
+
+        return numbfs_dir_insert(parent, item->name,
+                                 nid, S_ISLNK(item->mode) ? DT_LNK : DT_REG);
+}
+
+/* create a subdirectory from an ingest item and open it in @child */
+static int numbfs_ingest_dir(struct numbfs_ingest_item *item,
+                             struct numbfs_dir *parent,
+                             struct numbfs_dir *child)
+{
+        struct numbfs_inode_info ni;
+        int nid, err;
+
+        /* duplicate names in one source directory cannot happen */
+        nid = numbfs_empty_dir(&sbi, parent->inode.nid);
+        if (nid < 0)
+                return nid;
+
+        /* patch in the source directory's mode and ownership */
         ni.sbi = &sbi;
-        ni.nid = NUMBFS_ROOT_NID;
+        ni.nid = nid;
         err = numbfs_get_inode(&sbi, &ni);
+        if (err)
+                return err;
+        ni.mode = item->mode;
+        ni.uid = item->uid;
+        ni.gid = item->gid;
+        err = numbfs_dump_inode(&ni);
         if (err)
                 return err;
 
-        dir = (struct numbfs_dirent*)buf;
-        memcpy(dir->name, LOSTFOUND, LOSTFOUNDLEN);
-        dir->name[LOSTFOUNDLEN] = '\0';
-        dir->name_len = LOSTFOUNDLEN;
-        dir->ino = nid;
-        dir->type = DT_DIR;
-        err = numbfs_pwrite_inode(&ni, buf, ni.size, sizeof(*dir));
+        err = numbfs_dir_insert(parent, item->name, nid, DT_DIR);
         if (err)
                 return err;
-#undef  LOSTFOUND
-#undef  LOSTFOUNDLEN
-        return 0;
+        return numbfs_dir_open(&sbi, child, nid);
+}
+
+static int numbfs_populate_root(const char *dir)
+{
+        struct numbfs_ingest_item item;
+        struct numbfs_dir stack[NUMBFS_INGEST_MAX_DIRS];
+        int depth = 0, err = 0, err2;
+        pthread_t producer;
+
+        pthread_mutex_init(&ingest.lock, NULL);
+        pthread_cond_init(&ingest.not_empty, NULL);
+        pthread_cond_init(&ingest.not_full, NULL);
+
+        err = pthread_create(&producer, NULL, numbfs_ingest_producer,
+                             (void *)dir);
+        if (err)
+                return -err;
+
+        err = numbfs_dir_open(&sbi, &stack[0], NUMBFS_ROOT_NID);
+        if (err)
+                depth = -1;
+        while (numbfs_ingest_pop(&item)) {
+                if (err) {
+                        /* already failed: just drain and free */
+                        free(item.data);
+                        continue;
+                }
+
+                switch (item.type) {
+                case NUMBFS_INGEST_DIR_ENTER:
+                        if (depth + 1 >= NUMBFS_INGEST_MAX_DIRS) {
+                                fprintf(stderr, "source tree too deep\n");
+                                err = -ELOOP;
+                                break;
+                        }
+                        err = numbfs_ingest_dir(&item, &stack[depth],
+                                                &stack[depth + 1]);
+                        if (!err)
+                                depth++;
+                        break;
+                case NUMBFS_INGEST_FILE:
+                        err = numbfs_ingest_file(&item, &stack[depth]);
+                        free(item.data);
+                        break;
+                case NUMBFS_INGEST_DIR_LEAVE:
+                        err = numbfs_dir_close(&stack[depth--]);
+                        break;
+                }
+        }
+
+        /* close whatever is still open, the root handle included */
+        while (depth >= 0) {
+                err2 = numbfs_dir_close(&stack[depth--]);
+                if (!err)
+                        err = err2;
+        }
+
+        pthread_join(producer, NULL);
+        if (!err && ingest.err)
+                err = ingest.err;
+        if (err)
+                fprintf(stderr, "failed to populate image from %s\n", dir);
+        return err;
 }
 
 /*
@@ -176,12 +639,15 @@ static int numbfs_mkdir_lostfound(void)
  */
 static int numbfs_mkfs(void)
 {
-        int i, err, total_blocks, remain;
+        int i, cnt, err, total_blocks, remain;
+        __u32 ibm_crc = 0, itable_crc = 0, bbm_crc = 0;
         struct numbfs_super_block *sb;
-        char buf[BYTES_PER_BLOCK];
+        char buf[NUMBFS_MAX_BLOCK_SIZE];
+        char *chunk = NULL;
         off_t start, end;
         struct stat st;
         long long dev_size;
+        bool zeroed;
 
         err = fstat(sbi.fd, &st);
         if (err) {
@@ -216,66 +682,114 @@ static int numbfs_mkfs(void)
                 }
         }
 
-        if (sbi.size <=  2 * BYTES_PER_BLOCK + round_up(sbi.total_inodes * 64, BYTES_PER_BLOCK) + 3) {
+        if (sbi.size <=  2 * sbi.block_size + round_up(sbi.total_inodes * 64, sbi.block_size) + 3) {
                 fprintf(stderr, "device too small, should be at least %d Bytes\n",
-                                2 * BYTES_PER_BLOCK + round_up(sbi.total_inodes * 64, BYTES_PER_BLOCK) + 3);
+                                2 * sbi.block_size + round_up(sbi.total_inodes * 64, sbi.block_size) + 3);
                 close(sbi.fd);
                 return -EINVAL;
         }
 
-        total_blocks = sbi.size / BYTES_PER_BLOCK;
+        /* access regular-file images through one big mapping; direct
+         * mode skips it (it would reintroduce the page cache) and so
+         * does the journal (its write ordering cannot be expressed
+         * through a mapping) */
+        if (!sbi.direct && !(sbi.feature & NUMBFS_FEATURE_JOURNAL)) {
+                err = numbfs_map_device(&sbi, sbi.size);
+                if (err) {
+                        fprintf(stderr, "warning: failed to map image (%d), using file I/O\n",
+                                err);
+                        err = 0;
+                }
+        }
+        /* the init passes below sweep the zones front to back */
+        if (sbi.map)
+                madvise(sbi.map, sbi.size, MADV_SEQUENTIAL);
+
+        total_blocks = sbi.size / sbi.block_size;
 
+        /* the journal zone sits right after the superblock */
+        if (sbi.feature & NUMBFS_FEATURE_JOURNAL) {
+                sbi.journal_start = 2;
+                sbi.journal_blocks = journal_blocks;
+        }
         /* inode bitmap start block addr */
-        sbi.ibitmap_start = 2;
+        sbi.ibitmap_start = 2 + sbi.journal_blocks;
         /* inodes start block add */
         sbi.inode_start = sbi.ibitmap_start +
-                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.total_inodes, BITS_PER_BYTE), BYTES_PER_BLOCK);
+                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.total_inodes, BITS_PER_BYTE), sbi.block_size);
         /* block bitmap start block addr */
         sbi.bbitmap_start = sbi.inode_start +
-                        DIV_ROUND_UP(sbi.total_inodes * sizeof(struct numbfs_inode), BYTES_PER_BLOCK);
+                        DIV_ROUND_UP(sbi.total_inodes * sizeof(struct numbfs_inode), sbi.block_size);
 
         remain = total_blocks - sbi.bbitmap_start - 1;
         /* nr total data blocks */
         sbi.data_blocks = remain -
-                        DIV_ROUND_UP(DIV_ROUND_UP(remain, BITS_PER_BYTE), BYTES_PER_BLOCK);
+                        DIV_ROUND_UP(DIV_ROUND_UP(remain, BITS_PER_BYTE), sbi.block_size);
         sbi.free_blocks = sbi.data_blocks;
 
-        start = 2;
+        /*
+         * Start from block 0: a previous format with a smaller block
+         * size left its superblock below the new one, and a stale
+         * magic at a lower probe offset would shadow the new
+         * superblock in numbfs_get_superblock().
+         */
+        start = 0;
         end = sbi.bbitmap_start +
-                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.data_blocks, BITS_PER_BYTE), BYTES_PER_BLOCK);
-        memset(buf, 0, sizeof(buf));
-        /* clear all the bits in range [start, end] */
-        for (i = start; i < end; i++) {
-                err = pwrite(sbi.fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                if (err != BYTES_PER_BLOCK) {
-                        fprintf(stderr, "failed to write to block@[%d, %d]\n", i, i + 1);
-                        return -EIO;
-                }
-        }
-
-        /* set all the data array to NUMBFS_HOLE */
-        for (i = sbi.inode_start; i < sbi.bbitmap_start; i++) {
-                int j, k;
-                struct numbfs_inode *inode;
-
-                err = numbfs_read_block(&sbi, buf, i);
+                        DIV_ROUND_UP(DIV_ROUND_UP(sbi.data_blocks, BITS_PER_BYTE), sbi.block_size);
+
+        /* the inode zone stays all-zero, slots are read as empty inodes */
+        sbi.feature |= NUMBFS_FEATURE_LAZY_ITABLE;
+
+        /*
+         * Clear the metadata zones [start, end). Regular-file images
+         * get one fallocate() instead of writing zero blocks; block
+         * devices (or filesystems without zero-range support) fall
+         * back to large batched writes.
+         */
+        zeroed = false;
+        if (S_ISREG(st.st_mode) &&
+            !fallocate(sbi.fd, FALLOC_FL_ZERO_RANGE, start * sbi.block_size,
+                       (end - start) * sbi.block_size))
+                zeroed = true;
+
+        if (!zeroed && sbi.nthreads > 1) {
+                /* nothing is cached yet: workers write disjoint ranges */
+                err = numbfs_zero_range(&sbi, start, end - start);
                 if (err)
                         return err;
+                zeroed = true;
+        }
 
-                for (j = 0; j < (int)NUMBFS_NODES_PER_BLOCK; j++) {
-                        inode = ((struct numbfs_inode*)buf) + j;
-                        for (k = 0; k < NUMBFS_NUM_DATA_ENTRY; k++)
-                                inode->i_data[k] = cpu_to_le32(NUMBFS_HOLE);
+        if (!zeroed) {
+                chunk = numbfs_balloc(&sbi, (size_t)NUMBFS_IO_CHUNK_BLOCKS *
+                                            sbi.block_size);
+                if (!chunk)
+                        return -ENOMEM;
+                memset(chunk, 0, (size_t)NUMBFS_IO_CHUNK_BLOCKS *
+                                 sbi.block_size);
+
+                for (i = start; i < end; i += cnt) {
+                        cnt = min((int)end - i, NUMBFS_IO_CHUNK_BLOCKS);
+                        err = numbfs_iou_queue(&sbi, true, chunk, i, cnt);
+                        if (err)
+                                goto err_free;
                 }
-
-                err = numbfs_write_block(&sbi, buf, i);
+                err = numbfs_iou_flush(&sbi);
                 if (err)
-                        return err;
+                        goto err_free;
+                numbfs_bfree(&sbi, chunk);
+                chunk = NULL;
         }
 
         /* data zone start block addr */
         sbi.data_start = end;
 
+        err = numbfs_journal_init(&sbi);
+        if (err) {
+                fprintf(stderr, "failed to set up the journal, err: %d\n", err);
+                return err;
+        }
+
 #ifdef HAVE_NUMBFS_DEBUG
         printf("Superblock information:\n");
         printf("    num_inodes: %d\n", sbi.total_inodes);
@@ -296,10 +810,41 @@ static int numbfs_mkfs(void)
         if (err)
                 return err;
 
-        memset(buf, 0, BYTES_PER_BLOCK);
+        if (root_dir) {
+                err = numbfs_populate_root(root_dir);
+                if (err)
+                        return err;
+        }
+
+        if (sbi.feature & NUMBFS_FEATURE_CSUM) {
+                /* the zones must be stable on disk before they are summed */
+                err = numbfs_bitmap_flush(&sbi);
+                if (!err)
+                        err = numbfs_cache_flush(&sbi);
+                if (!err)
+                        err = numbfs_journal_commit(&sbi);
+                if (!err)
+                        err = numbfs_csum_zone(&sbi, sbi.ibitmap_start,
+                                        sbi.inode_start - sbi.ibitmap_start,
+                                        &ibm_crc);
+                if (!err)
+                        err = numbfs_csum_zone(&sbi, sbi.inode_start,
+                                        sbi.bbitmap_start - sbi.inode_start,
+                                        &itable_crc);
+                if (!err)
+                        err = numbfs_csum_zone(&sbi, sbi.bbitmap_start,
+                                        sbi.data_start - sbi.bbitmap_start,
+                                        &bbm_crc);
+                if (err) {
+                        fprintf(stderr, "failed to checksum the metadata zones\n");
+                        return err;
+                }
+        }
+
+        memset(buf, 0, sbi.block_size);
         sb = (struct numbfs_super_block*)buf;
         sb->s_magic = NUMBFS_MAGIC;
-        sb->s_feature = cpu_to_le32(0);
+        sb->s_feature = cpu_to_le32(sbi.feature);
         sb->s_ibitmap_start = cpu_to_le32(sbi.ibitmap_start);
         sb->s_inode_start = cpu_to_le32(sbi.inode_start);
         sb->s_bbitmap_start = cpu_to_le32(sbi.bbitmap_start);
@@ -308,14 +853,42 @@ static int numbfs_mkfs(void)
         sb->s_free_inodes = cpu_to_le32(sbi.free_inodes);
         sb->s_data_blocks = cpu_to_le32(sbi.data_blocks);
         sb->s_free_blocks = cpu_to_le32(sbi.free_blocks);
+        sb->s_block_size = cpu_to_le32(sbi.block_size);
+        sb->s_journal_start = cpu_to_le32(sbi.journal_start);
+        sb->s_journal_blocks = cpu_to_le32(sbi.journal_blocks);
+        if (sbi.feature & NUMBFS_FEATURE_CSUM) {
+                sb->s_ibitmap_csum = cpu_to_le32(ibm_crc);
+                sb->s_itable_csum = cpu_to_le32(itable_crc);
+                sb->s_bbitmap_csum = cpu_to_le32(bbm_crc);
+                sb->s_checksum = cpu_to_le32(numbfs_crc32c(0, sb,
+                                                sizeof(*sb)));
+        }
 
-        return numbfs_write_block(&sbi, buf, NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK);
+        /* the superblock always lives in block 1, whatever the block size */
+        return numbfs_write_block(&sbi, buf, 1);
+
+err_free:
+        numbfs_bfree(&sbi, chunk);
+        return err;
 }
 
 static void numbfs_cleanup(void)
 {
+        numbfs_iou_exit(&sbi);
+        if (numbfs_bitmap_release(&sbi))
+                fprintf(stderr, "Error: failed to flush bitmaps\n");
+        if (numbfs_cache_destroy(&sbi))
+                fprintf(stderr, "Error: failed to flush block cache\n");
+        if (numbfs_journal_release(&sbi))
+                fprintf(stderr, "Error: failed to commit the journal\n");
+        if (numbfs_unmap_device(&sbi))
+                fprintf(stderr, "Error: failed to sync image mapping\n");
+        numbfs_pool_release(&sbi);
         if (sbi.fd >= 0)
                 close(sbi.fd);
+        free(root_dir);
+        if (stats)
+                numbfs_stats_dump();
 }
 
 int main(int argc, char **argv)
@@ -340,5 +913,5 @@ int main(int argc, char **argv)
 
 exit:
         numbfs_cleanup();
-        return 0;
+        return err ? 1 : 0;
 }
@@ -12,7 +12,10 @@
 #define BUG_ON(cond)        assert(!(cond))
 
 #define BITS_PER_BYTE       8
+/* the default (and smallest) block size; see sbi->block_size */
 #define BYTES_PER_BLOCK     512
+/* the largest supported block size, used to size on-stack buffers */
+#define NUMBFS_MAX_BLOCK_SIZE   65536
 
 #define __round_mask(x, y)      ((__typeof__(x))((y)-1))
 #define round_up(x, y)          ((((x)-1) | __round_mask(x, y))+1)